@@ -34,25 +34,36 @@
 #include <cmath>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <queue>
+#include <type_traits>
 
 #include <htslib/sam.h>
 #include <htslib/bgzf.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include "bigWig.h"
 #ifdef WINDOWS_MINGW
     #include <unordered_map>
     #include <unordered_set>
     #include "getline.h"
     #include "mingw-std-threads/mingw.thread.h"
+    #include "mingw-std-threads/mingw.mutex.h"
+    #include "mingw-std-threads/mingw.condition_variable.h"
     template<class K, class V>
     using hashmap = std::unordered_map<K, V>;
     template<class V2>
     using hashset = std::unordered_set<V2>;
 #else
+    #include <fcntl.h>
+    #include <sys/mman.h>
     #include "robin_hood.h"
     template<class K, class V>
     using hashmap = robin_hood::unordered_map<K, V>;
@@ -79,13 +90,21 @@ const uint32_t default_BW_READ_BUFFER = 1<<30;
 uint32_t BW_READ_BUFFER = default_BW_READ_BUFFER;
 
 bool SUMS_ONLY = false;
+//--op bases counts the bases w/ at least this coverage
+double BASES_MIN_COVERAGE = 1;
+//--approximate: BigWig annotated intervals at least this long are summarized from the zoom levels (0 is off)
+uint32_t APPROXIMATE_MIN_LENGTH = 0;
+//--sums-binary(-varint): a BigWig's values for the first annotation are written in this encoding
+//(see SumsBinaryHeader) rather than as text, -1 is off
+static const int SUMS_FLOAT64 = 0;
+static const int SUMS_DELTA_VARINT = 1;
+int SUMS_BINARY = -1;
 
 typedef std::vector<std::string> strvec;
 //typedef hashmap<std::string, uint64_t> mate2len;
 typedef hashmap<std::string, uint64_t> mate2len;
-typedef hashmap<std::string, double*> str2dblist;
 
-uint64_t MAX_INT = (2^63);
+uint64_t MAX_INT = UINT64_MAX;
 //how many intervals to start with for a chromosome in a BigWig file
 //uint64_t STARTING_NUM_INTERVALS = 1000;
 uint64_t STARTING_NUM_INTERVALS = 1000000;
@@ -98,6 +117,10 @@ static const int LINE_BUFFER_LENGTH=1048576;
 static const int BIGWIG_INIT_VAL = 17;
 static double SOFTCLIP_POLYA_TOTAL_COUNT_MIN=3;
 static double SOFTCLIP_POLYA_RATIO_MIN=0.8;
+//"MDBCMTX1" little-endian, starts a --barcode-binary matrix file
+static const uint64_t BARCODE_MATRIX_MAGIC = 0x3158544D4342444D;
+//"MDSUMTX1" little-endian, starts an aggregate --binary matrix file
+static const uint64_t SUMS_MATRIX_MAGIC = 0x3158544D5553444D;
 
 static const void print_version() {
     //fprintf(stderr, "megadepth %s\n", string(MEGADEPTH_VERSION).c_str());
@@ -108,11 +131,13 @@ static const char USAGE[] = "BAM and BigWig utility.\n"
     "\n"
     "Usage:\n"
     "  megadepth <bam|bw|-> [options]\n"
+    "  megadepth aggregate <manifest> [options]\n"
     "\n"
     "Options:\n"
     "  -h --help                Show this screen.\n"
     "  --version                Show version.\n"
     "  --threads                # of threads to do: BAM decompression OR compute sums over multiple BigWigs in parallel\n"
+    "                            OR over the chromosomes of a single BigWig in parallel (largest first)\n"
     "                            if the 2nd is intended then a TXT file listing the paths to the BigWigs to process in parallel\n"
     "                            should be passed in as the main input file instead of a single BigWig file (EXPERIMENTAL).\n"
     "  --prefix                 String to use to prefix all output files.\n"
@@ -122,6 +147,16 @@ static const char USAGE[] = "BAM and BigWig utility.\n"
     "  --keep-order             Output annotation coverage in the order chromosomes appear in the BAM/BigWig file\n"
     "                           The default is to output annotation coverage in the order chromosomes appear in the annotation BED file.\n"
     "                           This is only applicable if --annotation is used for either BAM or BigWig input.\n"
+    "                           Either way, the rows within a chromosome are output in their BED file order.\n"
+    "  --annotation-cache <file> Load the --annotation BED from this binary cache (mmap'd w/o parsing,\n"
+    "                           shared between concurrent runs), first compiling it from the BED if\n"
+    "                           it's missing or the BED has changed since.\n"
+    "  --annotation <bed>[,<label>[,<op>...]]\n"
+    "                           --annotation can be repeated to sum every BED from the same pass over the input.\n"
+    "                           A labeled BED (later ones default to their file name w/o its extension) is written\n"
+    "                           to <prefix>.<label>.tsv (and <prefix>.<label>.<track>.tsv for other BAM coverage tracks)\n"
+    "                           using its own ops (any after the label).  Labels must be distinct.  Annotated AUCs, --annotation-cache\n"
+    "                           and --aggregate-by-name apply to the first --annotation.\n"
     "\n"
     "BigWig Input:\n"
     "Extract regions and their counts from a BigWig outputting BED format if a BigWig file is detected as input (exclusive of the other BAM modes):\n"
@@ -129,10 +164,31 @@ static const char USAGE[] = "BAM and BigWig utility.\n"
     "                                           This will also report the AUC over the annotated regions to STDOUT.\n"
     "                                           If only the name of the BigWig file is passed in with no other args, it will *only* report total AUC to STDOUT.\n"
     "  --annotation <bed>                      Only output the regions in this BED applying the argument to --op to them.\n"
-    "  --op <sum[default], mean, min, max>     Statistic to run on the intervals provided by --annotation\n"
+    "  --op <op[,op...]>                       Statistics to run on the intervals provided by --annotation, one column each\n"
+    "                                           in the order given, from one pass over the BigWig: sum[default], mean, min, max,\n"
+    "                                           median, bases (# of bases w/ a value >= --min-coverage <float>, default 1)\n"
     "  --sums-only                             Discard coordinates from output of summarized regions\n"
+    "  --sums-binary                           Write the (first) --annotation's values (of the first --op) in BED order to\n"
+    "                                           <prefix>.sums.bin (<BigWig>.sums.bin per listed BigWig) rather than as text:\n"
+    "                                           a 32 byte header (\"MDSUMS01\", uint32_t encoding & sample ID length,\n"
+    "                                           uint64_t # of values & annotation checksum), the sample ID 0 padded to 8 bytes,\n"
+    "                                           then a double per BED row (little-endian).  aggregate reads these directly\n"
+    "  --sums-binary-varint                    The same but each row's rounded value as a zigzag LEB128 varint of its\n"
+    "                                           difference from the previous row's (encoding 1)\n"
+    "  --matrix                                With a .txt list of BigWigs, write the (first) --annotation's values for all of them\n"
+    "                                           to one bgzipped <prefix>.matrix.tsv.gz, a column per BigWig in the list's order\n"
+    "                                           & a row per BED row in its order, plus <prefix>.manifest.tsv w/ their AUCs\n"
+    "                                           (no per BigWig files)\n"
+    "  --batch <int>                           With a .txt list of BigWigs, each thread opens this many at a time and\n"
+    "                                           goes through them chromosome by chromosome, reading the annotation once for all\n"
+    "  --approximate <int>                     Take the ops over annotated regions at least this long from the BigWig's\n"
+    "                                           zoom levels (the coarsest still finer than the region) rather than\n"
+    "                                           its base level values; sum, mean, min & max only\n"
+    "  --exact                                 Sum every interval for the total AUC rather than taking it from the BigWig's\n"
+    "                                           header summary (or zoom levels) when it has one\n"
     "  --bwbuffer <1GB[default]>               Size of buffer for reading BigWig files, critical to use a large value (~1GB) for remote BigWigs.\n"
     "                                           Default setting should be fine for most uses, but raise if very slow on a remote BigWig.\n"
+    "                                           W/o it the default is split between the --threads (down to 16MB each).\n"
     "\n"
     "\n"
     "BAM Input:\n"
@@ -162,82 +218,81 @@ static const char USAGE[] = "BAM and BigWig utility.\n"
     "                       Defaults to STDOUT, unless other params are passed in as well, then\n"
     "                       if writes to a TSV file <prefix>.auc.tsv\n"
     "  --bigwig             Output coverage as BigWig file(s).  Writes to <prefix>.bw\n"
-    "                       (also <prefix>.unique.bw when --min-unique-qual is specified).\n"
+    "                       (also <prefix>.unique.bw when --min-unique-qual is specified,\n"
+    "                       or <prefix>.unique.q<int>.bw per threshold if it's given a list).\n"
     "                       Requires libBigWig.\n"
     "  --annotation <bed>   Path to BED file containing list of regions to sum coverage over\n"
     "                       (tab-delimited: chrm,start,end)\n"
-    "  --min-unique-qual <int>\n"
+    "  --op <op[,op...]>    Statistics to output per --annotation interval, one column each in\n"
+    "                       the order given: sum[default], mean, min, max, median, bases\n"
+    "                       (# of bases w/ coverage >= --min-coverage <int>, default 1)\n"
+    "  --aggregate-by-name  Also sum coverage over the union of the --annotation intervals sharing\n"
+    "                       a name (4th BED column, e.g. a gene's exons), so overlapping intervals\n"
+    "                       count once.  Writes name, union length, sum, mean (sum / union length)\n"
+    "                       per name in BED order to <prefix>.annotation.by_name.tsv\n"
+    "                       (and <prefix>.<track>.by_name.tsv for the other coverage tracks)\n"
+    "  --min-unique-qual <int[,int...]>\n"
     "                       Output second bigWig consisting built only from alignments\n"
     "                       with at least this mapping quality.  --bigwig must be specified.\n"
     "                       Also produces second set of annotation sums based on this coverage\n"
     "                       if --annotation is enabled\n"
+    "                       A comma separated list (e.g. 1,10,255) produces one set of\n"
+    "                       outputs per threshold (<prefix>.unique.q<int>.*) in a single pass\n"
+    "  --stranded <fr-firststrand|fr-secondstrand|unstranded>\n"
+    "                       Also keep separate coverage for fragments from each strand\n"
+    "                       given the library type (fr-firststrand is e.g. dUTP).\n"
+    "                       Writes <prefix>.plus.bw/<prefix>.minus.bw with --bigwig and\n"
+    "                       <prefix>.plus.tsv/<prefix>.minus.tsv with --annotation\n"
+    "                       (\"unstranded\" adds no strand tracks)\n"
+    "  --split-by RG        Keep separate coverage for each read group (RG:Z tag) in one pass.\n"
+    "                       All coverage outputs (BigWigs, annotation sums) are written per\n"
+    "                       read group to <prefix>.<RG>.*, and AUCs are reported per read group\n"
+    "                       (alignments w/o an RG tag go to the \"NO_RG\" group)\n"
+    "  --umi-dedup <tag>    Only count the first alignment of each group sharing a start, strand,\n"
+    "                       mate start and UMI (in <tag>, e.g. UB or RX) toward coverage,\n"
+    "                       AUCs and annotation sums, 2nd mates follow their 1st mate.\n"
+    "                       Requires a coordinate sorted BAM, replaces a separate dedup pass\n"
+    "  --umi-mismatch       Also treat UMIs w/ 1 mismatch as the same molecule for --umi-dedup\n"
     "  --double-count       Allow overlapping ends of PE read to count twice toward\n"
     "                       coverage\n"
     "  --num-bases          Report total sum of bases in alignments processed (that pass filters)\n"
     "\n"
+    "Single cell counts:\n"
+    "  --barcode-counts     Count alignments per cell barcode over each --annotation interval,\n"
+    "                       accumulated sparsely rather than as per-base coverage.  Writes a\n"
+    "                       Matrix Market interval x barcode matrix to <prefix>.barcodes.mtx\n"
+    "                       (rows in BED order) w/ <prefix>.features.tsv & <prefix>.barcodes.tsv.\n"
+    "                       With --threads > 1 and a BAM index, chromosomes are counted in parallel\n"
+    "  --barcode-tag <tag>  Tag holding the cell barcode (default: CB)\n"
+    "  --umi-tag <tag>      Count distinct UMIs (e.g. UB) per barcode & interval instead of alignments\n"
+    "  --barcode-binary     Write the matrix as <prefix>.barcodes.bin instead: 4 uint64_t's\n"
+    "                       (magic, # rows, # barcodes, # entries) then row,barcode,count uint32_t's\n"
+    "                       per entry (0-based, little-endian)\n"
+    "\n"
     "Other outputs:\n"
     "  --read-ends          Print counts of read starts/ends, if --min-unique-qual is set\n"
     "                       then only the alignments that pass that filter will be counted here\n"
+    "                       (the first threshold if a list is given)\n"
     "                       Writes to 2 TSV files: <prefix>.starts.tsv, <prefix>.ends.tsv\n"
     "  --frag-dist          Print fragment length distribution across the genome\n"
     "                       Writes to a TSV file <prefix>.frags.tsv\n"
     "  --echo-sam           Print a SAM record for each aligned read\n"
     "  --ends               Report end coordinate for each read (useful for debugging)\n"
     "  --test-polya         Lower Poly-A filter minimums for testing (only useful for debugging/testing)\n"
+    "\n"
+    "Aggregate:\n"
+    "Merge per-sample sum files (e.g. from --sums-only) into one matrix, a column per sample, taking the last\n"
+    "column of each line (or from --sums-binary files).  The manifest has a line per sample: <sample ID>TAB<file>, or <study>TAB<sample ID>TAB<file>...\n"
+    "Empty or missing files are filled in w/ 0's.  More than 1000 samples are first merged in groups of 1000\n"
+    "(so each file is only opened once) into temporary <prefix>.aggregate.* files, which are removed at the end.\n"
+    "  --prefix <prefix>    Writes <prefix>.tsv.gz (bgzipped, a header of the sample IDs then the rows), default the manifest\n"
+    "  --threads <int>      # of threads reading the sum files & compressing the output\n"
+    "  --convert-to-int     Drop all-0 decimals (e.g. 12.000 => 12)\n"
+    "  --block-rows <int>   # of rows read from all of the samples at a time, bounding the memory (default 4096)\n"
+    "  --binary             Write <prefix>.bin instead: 3 uint64_t's (magic, # rows, # samples) then each row's\n"
+    "                       doubles (little-endian), w/ the sample IDs in <prefix>.samples.tsv\n"
     "\n";
 
-template <typename T>
-void print_local(FILE* afp,const char* c, long start, long end, T val, double* local_vals, long z) { }
-
-template <typename T>
-void print_local_sums_only(FILE* afp,const char* c, long start, long end, T val, double* local_vals, long z) { }
-
-template <typename T>
-void print_shared(FILE* afp,const char* c, long start, long end, T val, double* local_vals, long z) { }
-
-template <typename T>
-void print_shared_sums_only(FILE* afp,const char* c, long start, long end, T val, double* local_vals, long z) { }
-
-template <>
-void print_local<long>(FILE* afp,const char* c, long start, long end, long val, double* local_vals, long z) {
-        fprintf(afp, "%s\t%lu\t%lu\t%lu\n", c, start, end, (long) local_vals[z]);
-}
-
-template <>
-void print_local_sums_only<long>(FILE* afp,const char* c, long start, long end, long val, double* local_vals, long z) {
-        fprintf(afp, "%lu\n", (long) local_vals[z]);
-}
-
-template <>
-void print_shared<long>(FILE* afp,const char* c, long start, long end, long val, double* local_vals, long z) {
-        fprintf(afp, "%s\t%lu\t%lu\t%lu\n", c, start, end, val);
-}
-
-template <>
-void print_shared_sums_only<long>(FILE* afp,const char* c, long start, long end, long val, double* local_vals, long z) {
-        fprintf(afp, "%lu\n", val);
-}
-
-template <>
-void print_shared<double>(FILE* afp, const char* c, long start, long end, double val, double* local_vals, long z) {
-        fprintf(afp, "%s\t%lu\t%lu\t%.3f\n", c, (long) start, (long) end, val);
-}
-
-template <>
-void print_shared_sums_only<double>(FILE* afp, const char* c, long start, long end, double val, double* local_vals, long z) {
-        fprintf(afp, "%.3f\n", val);
-}
-
-template <>
-void print_local<double>(FILE* afp, const char* c, long start, long end, double val, double* local_vals, long z) {
-        fprintf(afp, "%s\t%lu\t%lu\t%.3f\n", c, (long) start, (long) end, local_vals[z]);
-}
-
-template <>
-void print_local_sums_only<double>(FILE* afp, const char* c, long start, long end, double val, double* local_vals, long z) {
-        fprintf(afp, "%.3f\n", local_vals[z]);
-}
-
 static const char* get_positional_n(const char ** begin, const char ** end, size_t n) {
     size_t i = 0;
     for(const char **itr = begin; itr != end; itr++) {
@@ -267,6 +322,19 @@ static const char** get_option(
     return itr + shift + 1;
 }
 
+/**
+ * Collect the argument after every occurrence of a repeatable option.
+ */
+static void get_options(
+        const char** begin,
+        const char** end,
+        const std::string& option,
+        std::vector<const char*>* args)
+{
+    for(const char** itr = std::find(begin, end, option); itr != end; itr = std::find(itr + 1, end, option))
+        args->push_back(*(itr + 1));
+}
+
 /**
  * Holds an MDZ "operation"
  * op can be 
@@ -584,94 +652,188 @@ static void reset_array(uint32_t* arr, const long arr_sz) {
         arr[i] = 0;
 }
 
+//per-base coverage for all the tracks (all reads, unique reads, etc...)
+//is kept in one array interleaved by position: coverages[pos * num_tracks + track]
+//so updating, scanning and summing every track for a given position
+//touches one cache line rather than one per track
+static const int ALL_TRACK = 0;
+static const int MAX_COVERAGE_TRACKS = 32;
+struct CoverageTrack {
+    //used in the output file names (e.g. <prefix>.<name>.bw)
+    std::string name;
+    //used for the AUC report lines (e.g. <label>_ALL_BASES)
+    std::string auc_label;
+    bigWigFile_t* bwfp;
+    uint64_t auc;
+    //over the first annotation set
+    uint64_t annotated_auc;
+    CoverageTrack(const std::string& name_, const std::string& auc_label_) : 
+        name(name_), auc_label(auc_label_), bwfp(nullptr), auc(0), annotated_auc(0) { }
+};
+typedef std::vector<CoverageTrack> coverage_tracks;
+
+//parses the comma separated list of MAPQ thresholds passed to --min-unique-qual
+//each threshold gets its own coverage track
+static int parse_min_unique_quals(const char* arg, std::vector<int>* min_quals) {
+    if(!arg)
+        return -1;
+    const char* p = arg;
+    while(*p != '\0') {
+        char* endp = nullptr;
+        long qual = strtol(p, &endp, 10);
+        if(endp == p || (*endp != ',' && *endp != '\0')) {
+            fprintf(stderr, "ERROR: could not parse --min-unique-qual argument \"%s\"\n", arg);
+            return -1;
+        }
+        min_quals->push_back((int) qual);
+        p = *endp == ','?endp+1:endp;
+    }
+    if(min_quals->empty() || min_quals->size() >= MAX_COVERAGE_TRACKS) {
+        fprintf(stderr, "ERROR: --min-unique-qual takes between 1 and %d thresholds\n", MAX_COVERAGE_TRACKS-1);
+        return -1;
+    }
+    return 0;
+}
+
+//library types for --stranded
+enum StrandType { unknown_strandedness=-1, unstranded, fr_firststrand, fr_secondstrand };
+StrandType get_strand_type(const char* typestr) {
+    if(!typestr)
+        return unknown_strandedness;
+    if(strcmp(typestr, "unstranded") == 0)
+        return unstranded;
+    if(strcmp(typestr, "fr-firststrand") == 0)
+        return fr_firststrand;
+    if(strcmp(typestr, "fr-secondstrand") == 0)
+        return fr_secondstrand;
+    return unknown_strandedness;
+}
+
+//returns true if the fragment this alignment is part of came from the plus strand
+//(single end reads are treated like the 1st mate)
+static inline bool fragment_on_plus_strand(const bam1_t* rec, const StrandType library_type) {
+    bool reverse = (rec->core.flag & BAM_FREVERSE) != 0;
+    //flip the 2nd mate so both mates of a pair agree
+    if((rec->core.flag & BAM_FPAIRED) != 0 && (rec->core.flag & BAM_FREAD2) != 0)
+        reverse = !reverse;
+    //e.g. dUTP, the 1st mate is the reverse complement of the transcript
+    if(library_type == fr_firststrand)
+        return reverse;
+    return !reverse;
+}
+
 //used for buffering up text/gz output
 int OUT_BUFF_SZ=4000000;
 int COORD_STR_LEN=34;
 typedef hashmap<uint32_t,uint32_t> int2int;
-static uint64_t print_array(const char* prefix, 
-                        char* chrm,
+//state of the current run of identical coverage values for one track
+struct CoverageRun {
+    float value;
+    uint32_t start;
+    bool first_print;
+    char* buf;
+    char* bufptr;
+    int buf_written;
+    //text coverage for all but the first track is spilled here
+    //so each track is still written out contiguously per chromosome
+    FILE* spill_fh;
+};
+
+static void flush_coverage_buffer(CoverageRun* run, FILE* fh) {
+    if(run->buf_written == 0)
+        return;
+    run->bufptr[0]='\0';
+    fprintf(fh, "%s", run->buf);
+    run->bufptr = run->buf;
+    run->buf_written = 0;
+}
+
+static inline uint64_t output_coverage_run(char* chrm, CoverageRun* run, uint32_t end, bigWigFile_t* bwfp, FILE* cov_fh,
+                                           const int num_lines_per_buf, const bool skip_zeros, const bool dont_output_coverage) {
+    if(run->value <= 0 && skip_zeros)
+        return 0;
+    //based on wiggletools' AUC calculation
+    uint64_t auc = (end - run->start) * ((long) run->value);
+    if(dont_output_coverage)
+        return auc;
+    if(bwfp && run->first_print)
+        bwAddIntervals(bwfp, &chrm, &run->start, &end, &run->value, 1);
+    else if(bwfp)
+        bwAppendIntervals(bwfp, &run->start, &end, &run->value, 1);
+    else {
+        if(run->buf_written >= num_lines_per_buf) {
+            if(!cov_fh && !run->spill_fh)
+                run->spill_fh = tmpfile();
+            flush_coverage_buffer(run, cov_fh?cov_fh:run->spill_fh);
+        }
+        run->bufptr += sprintf(run->bufptr, "%s\t%u\t%u\t%.0f\n", chrm, run->start, end, run->value);
+        run->buf_written++;
+    }
+    run->first_print = false;
+    return auc;
+}
+
+//run-length encodes all the tracks of the interleaved coverage array in a single pass,
+//writing each track's runs to its own BigWig (or as text to cov_fh) and adding to its AUC
+static void print_array(char* chrm,
                         const uint32_t* arr, 
+                        const int num_tracks,
                         const long arr_sz,
                         const bool skip_zeros,
-                        bigWigFile_t* bwfp,
+                        coverage_tracks* tracks,
                         FILE* cov_fh,
                         const bool dont_output_coverage = false) {
-    bool first = true;
-    bool first_print = true;
-    float running_value = 0;
-    uint32_t last_pos = 0;
-    uint64_t auc = 0;
+    if(arr_sz == 0)
+        return;
     //from https://stackoverflow.com/questions/27401388/efficient-gzip-writing-with-gzprintf
     int chrnamelen = strlen(chrm);
     int total_line_len = chrnamelen + COORD_STR_LEN;
     int num_lines_per_buf = round(OUT_BUFF_SZ / total_line_len) - 3;
-    //fprintf(stdout, "num_lines_per_buf %d\n", num_lines_per_buf);
-    int buf_written = 0;
-    char* buf = nullptr;
-    char* bufptr = nullptr;
-    if(!bwfp) {
-      buf = new char[OUT_BUFF_SZ];
-      bufptr = buf;
-    }
-    //TODO: speed this up, maybe keep a separate vector
-    //which tracks where the runs of the same value stop
-    //then only loop through that one w/o the if's
-    //
-    //OR
-    //
-    //create modules (functions/classes) which determine
-    //the type of output ahead of time to get rid of the if's
-    //
+    CoverageRun runs[MAX_COVERAGE_TRACKS];
+    int t;
+    for(t = 0; t < num_tracks; t++) {
+        CoverageRun& run = runs[t];
+        run.value = arr[t];
+        run.start = 0;
+        run.first_print = true;
+        run.buf = nullptr;
+        run.bufptr = nullptr;
+        run.buf_written = 0;
+        run.spill_fh = nullptr;
+        if(!dont_output_coverage && !(*tracks)[t].bwfp) {
+            run.buf = new char[OUT_BUFF_SZ];
+            run.bufptr = run.buf;
+        }
+    }
     //this will print the coordinates in base-0
-    for(uint32_t i = 0; i < arr_sz; i++) {
-        if(first || running_value != arr[i]) {
-            if(!first) {
-                if(running_value > 0 || !skip_zeros) {
-                    //based on wiggletools' AUC calculation
-                    auc += (i - last_pos) * ((long) running_value);
-                    if(not dont_output_coverage) {
-                        if(bwfp && first_print)
-                            bwAddIntervals(bwfp, &chrm, &last_pos, &i, &running_value, 1);
-                        else if(bwfp)
-                            bwAppendIntervals(bwfp, &last_pos, &i, &running_value, 1);
-                        else {
-                            if(buf_written >= num_lines_per_buf) {
-                                bufptr[0]='\0';
-                                fprintf(cov_fh, "%s", buf); 
-                                bufptr = buf;
-                                buf_written = 0;
-                            }
-                            bufptr += sprintf(bufptr, "%s\t%u\t%u\t%.0f\n", chrm, last_pos, i, running_value);
-                            buf_written++;
-                        } 
-                        first_print = false;
-                    }
-                }
+    for(uint32_t i = 1; i < arr_sz; i++) {
+        const uint32_t* pos_covs = arr + ((long) i) * num_tracks;
+        for(t = 0; t < num_tracks; t++) {
+            if(runs[t].value != pos_covs[t]) {
+                (*tracks)[t].auc += output_coverage_run(chrm, &runs[t], i, (*tracks)[t].bwfp, t == ALL_TRACK?cov_fh:nullptr,
+                                                        num_lines_per_buf, skip_zeros, dont_output_coverage);
+                runs[t].value = pos_covs[t];
+                runs[t].start = i;
             }
-            first = false;
-            running_value = arr[i];
-            last_pos = i;
         }
     }
-    if(!first) {
-        if(running_value > 0 || !skip_zeros) {
-            auc += (arr_sz - last_pos) * ((long) running_value);
-            if(not dont_output_coverage) {
-                if(bwfp && first_print)
-                    bwAddIntervals(bwfp, &chrm, &last_pos, (uint32_t*) &arr_sz, &running_value, 1);
-                else if(bwfp)
-                    bwAppendIntervals(bwfp, &last_pos, (uint32_t*) &arr_sz, &running_value, 1);
-                else {
-                    if(buf_written > 0) {
-                        bufptr[0]='\0';
-                        fprintf(cov_fh, "%s", buf); 
-                    }
-                    fprintf(cov_fh, "%s\t%u\t%lu\t%.0f\n", chrm, last_pos, arr_sz, running_value);
-                }
-            }
+    for(t = 0; t < num_tracks; t++) {
+        CoverageRun& run = runs[t];
+        (*tracks)[t].auc += output_coverage_run(chrm, &run, (uint32_t) arr_sz, (*tracks)[t].bwfp, t == ALL_TRACK?cov_fh:nullptr,
+                                                num_lines_per_buf, skip_zeros, dont_output_coverage);
+        if(run.spill_fh) {
+            char copy_buf[BUFSIZ];
+            size_t nread;
+            rewind(run.spill_fh);
+            while((nread = fread(copy_buf, 1, BUFSIZ, run.spill_fh)) > 0)
+                fwrite(copy_buf, 1, nread, cov_fh);
+            fclose(run.spill_fh);
+        }
+        if(run.buf) {
+            flush_coverage_buffer(&run, cov_fh);
+            delete[] run.buf;
         }
     }
-    return auc;
 }
 
 //generic function to loop through cigar
@@ -734,30 +896,56 @@ static void extract_junction(const int op, const int len, args_list* out) {
 
 
 typedef hashmap<std::string, uint32_t*> read2len;
-static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages, 
-                                        uint32_t* unique_coverages, const bool double_count, 
-                                        const int min_qual, read2len* overlapping_mates,
-                                        int32_t* total_intron_length) {
+//adds delta to every track in tracks[0..n) for the bases in [start,end)
+//of the interleaved coverage array
+static inline void update_coverage(uint32_t* coverages, const int num_tracks, const int* tracks, const int n,
+                                   const int32_t start, const int32_t end, const int delta) {
+    if(num_tracks == 1) {
+        if(n == 0)
+            return;
+        for(int32_t z = start; z < end; z++)
+            coverages[z] += delta;
+        return;
+    }
+    for(int32_t z = start; z < end; z++) {
+        uint32_t* pos_covs = coverages + ((long) z) * num_tracks;
+        for(int t = 0; t < n; t++)
+            pos_covs[tracks[t]] += delta;
+    }
+}
+
+//converts a bitmask of tracks into a list of track indexes
+static inline int tracks_from_mask(uint32_t mask, int* tracks) {
+    int n = 0;
+    for(int t = 0; mask != 0; t++, mask >>= 1) {
+        if(mask & 1)
+            tracks[n++] = t;
+    }
+    return n;
+}
+
+//track_mask has a bit set for every coverage track this alignment counts toward
+static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages, const int num_tracks,
+                                        const uint32_t track_mask, const bool double_count, 
+                                        read2len* overlapping_mates, int32_t* total_intron_length) {
     int32_t refpos = rec->core.pos;
     int32_t mrefpos = rec->core.mpos;
     //lifted from htslib's bam_cigar2rlen(...) & bam_endpos(...)
     int32_t algn_end_pos = refpos;
     const uint32_t* cigar = bam_get_cigar(rec);
-    int k, z;
+    int k;
     //check for overlapping mate and corect double counting if exists
     char* qname = bam_get_qname(rec);
-    bool unique = min_qual > 0;
-    bool passing_qual = rec->core.qual >= min_qual;
     //fix paired mate overlap double counting
     //fix overlapping mate pair, only if 1) 2nd mate and 
-    //2) we're either not unique, or we're higher than the required quality
+    //2) only for those tracks which both mates count toward
     int32_t mendpos = 0;
     int n_mspans = 0;
     int32_t** mspans = nullptr;
     int mspans_idx = 0;
     const std::string tn(qname);
     int32_t end_pos = bam_endpos(rec);
-    uint32_t mate_passes_quality = 0;
+    uint32_t mate_track_mask = 0;
     //-----First Mate Check
     //if we're the first mate and
     //we're avoiding double counting and we're a proper pair
@@ -775,7 +963,7 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
             uint32_t* mate_info = new uint32_t[n_cigar+3];
             mate_info[0] = n_cigar;
             mate_info[1] = refpos;
-            mate_info[2] = unique && passing_qual;
+            mate_info[2] = track_mask;
             std::memcpy(mate_info+3, mcigar, 4*n_cigar);
             (*overlapping_mates)[tn] = mate_info;
         }
@@ -784,7 +972,7 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
             uint32_t* mate_info = (*overlapping_mates)[tn];
             uint32_t mn_cigar = mate_info[0];
             int32_t real_mate_pos = mate_info[1];
-            mate_passes_quality = mate_info[2];
+            mate_track_mask = mate_info[2];
             uint32_t* mcigar = &(mate_info[3]);
             //bash cigar to get spans of overlap
             int32_t malgn_end_pos = real_mate_pos;
@@ -794,7 +982,7 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
                 if(bam_cigar_type(cigar_op)&2) {
                     const int32_t len = bam_cigar_oplen(mcigar[k]);
                     if(bam_cigar_type(cigar_op)&1) {
-                        mspans[mspans_idx] = new int32_t(2);
+                        mspans[mspans_idx] = new int32_t[2];
                         mspans[mspans_idx][0] = malgn_end_pos;
                         mspans[mspans_idx][1] = malgn_end_pos + len;
                         mspans_idx++;
@@ -809,110 +997,55 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
         }
     }
     mspans_idx = 0;
-    if(unique && passing_qual) {
-        int32_t lastref = 0;
-        for (k = 0; k < rec->core.n_cigar; ++k) {
-            const int cigar_op = bam_cigar_op(cigar[k]);
-            //do we consume ref?
-            if(bam_cigar_type(cigar_op)&2) {
-                const int32_t len = bam_cigar_oplen(cigar[k]);
-                if(cigar_op == BAM_CREF_SKIP)
-                    (*total_intron_length) = (*total_intron_length) + len;
-                //are we calc coverages && do we consume query?
-                if(coverages && bam_cigar_type(cigar_op)&1) {
-                    for(z = algn_end_pos; z < algn_end_pos + len; z++) {
-                        coverages[z]++;
-                        unique_coverages[z]++;
-                    }
-                    //now fixup overlapping segment but only if mate passed quality
-                    if(n_mspans > 0 && algn_end_pos < mendpos) {
-                        //loop until we find the next overlapping span
-                        //if are current segment is too early we just keep the span index where it is
-                        while(mspans_idx < n_mspans && algn_end_pos >= mspans[mspans_idx][1])
+    //tracks to count this alignment toward
+    int inc_tracks[MAX_COVERAGE_TRACKS];
+    const int n_inc = tracks_from_mask(track_mask, inc_tracks);
+    //tracks where the overlap with the mate was already counted
+    int dec_tracks[MAX_COVERAGE_TRACKS];
+    const int n_dec = tracks_from_mask(track_mask & mate_track_mask, dec_tracks);
+    for (k = 0; k < rec->core.n_cigar; ++k) {
+        const int cigar_op = bam_cigar_op(cigar[k]);
+        //do we consume ref?
+        if(bam_cigar_type(cigar_op)&2) {
+            const int32_t len = bam_cigar_oplen(cigar[k]);
+            if(cigar_op == BAM_CREF_SKIP)
+                (*total_intron_length) = (*total_intron_length) + len;
+            //are we calc coverages && do we consume query?
+            if(coverages && bam_cigar_type(cigar_op)&1) {
+                update_coverage(coverages, num_tracks, inc_tracks, n_inc, algn_end_pos, algn_end_pos + len, 1);
+                //now fixup overlapping segment
+                if(n_mspans > 0 && algn_end_pos < mendpos) {
+                    //loop until we find the next overlapping span
+                    //if are current segment is too early we just keep the span index where it is
+                    while(mspans_idx < n_mspans && algn_end_pos >= mspans[mspans_idx][1])
+                        mspans_idx++;
+                    int32_t cur_end = algn_end_pos + len;
+                    int32_t left_end = algn_end_pos;
+                    if(mspans_idx < n_mspans && left_end < mspans[mspans_idx][0])
+                        left_end = mspans[mspans_idx][0];
+                    //check 1) we've still got mate spans 2) current segment overlaps the current mate span
+                    while(mspans_idx < n_mspans && left_end < mspans[mspans_idx][1] 
+                                                && cur_end > mspans[mspans_idx][0]) {
+                        //set right end of segment to decrement
+                        int32_t right_end = cur_end;
+                        int32_t next_left_end = left_end;
+                        if(right_end >= mspans[mspans_idx][1]) {
+                            right_end = mspans[mspans_idx][1];
+                            //if our segment is greater than the previous mate's
+                            //also increment the mate spans index
                             mspans_idx++;
-                        int32_t cur_end = algn_end_pos + len;
-                        int32_t left_end = algn_end_pos;
-                        if(left_end < mspans[mspans_idx][0])
-                            left_end = mspans[mspans_idx][0];
-                        //check 1) we've still got mate spans 2) current segment overlaps the current mate span
-                        while(mspans_idx < n_mspans && left_end < mspans[mspans_idx][1] 
-                                                    && cur_end > mspans[mspans_idx][0]) {
-                            //set right end of segment to decrement
-                            int32_t right_end = cur_end;
-                            int32_t next_left_end = left_end;
-                            if(right_end >= mspans[mspans_idx][1]) {
-                                right_end = mspans[mspans_idx][1];
-                                //if our segment is greater than the previous mate's
-                                //also increment the mate spans index
-                                mspans_idx++;
-                                if(mspans_idx < n_mspans)
-                                    next_left_end = mspans[mspans_idx][0];
-                            }
-                            else {
-                                next_left_end = mspans[mspans_idx][1];
-                            }
-                            for(z = left_end; z < right_end; z++) {
-                                coverages[z]--;
-                                if(mate_passes_quality)
-                                    unique_coverages[z]--;
-                            }
-                            left_end = next_left_end;
+                            if(mspans_idx < n_mspans)
+                                next_left_end = mspans[mspans_idx][0];
                         }
-                    }    
-                }
-                algn_end_pos += len;
-            }
-        }
-    } else {
-        for (k = 0; k < rec->core.n_cigar; ++k) {
-            const int cigar_op = bam_cigar_op(cigar[k]);
-            //do we consume ref?
-            if(bam_cigar_type(cigar_op)&2) {
-                const int32_t len = bam_cigar_oplen(cigar[k]);
-                if(cigar_op == BAM_CREF_SKIP)
-                    (*total_intron_length) = (*total_intron_length) + len;
-                //are we calc coverages && do we consume query?
-                if(coverages && bam_cigar_type(cigar_op)&1) {
-                    for(z = algn_end_pos; z < algn_end_pos + len; z++) {
-                        coverages[z]++;
-                    }
-                    //now fixup overlapping segment
-                    if(n_mspans > 0 && algn_end_pos < mendpos) {
-                        //loop until we find the next overlapping span
-                        //if are current segment is too early we just keep the span index where it is
-                        while(mspans_idx < n_mspans && algn_end_pos >= mspans[mspans_idx][1])
-                            mspans_idx++;
-                        int32_t cur_end = algn_end_pos + len;
-                        int32_t left_end = algn_end_pos;
-                        if(left_end < mspans[mspans_idx][0])
-                            left_end = mspans[mspans_idx][0];
-                        //check 1) we've still got mate spans 2) current segment overlaps the current mate span
-                        while(mspans_idx < n_mspans && left_end < mspans[mspans_idx][1] 
-                                                    && cur_end > mspans[mspans_idx][0]) {
-                            //set right end of segment to decrement
-                            int32_t right_end = cur_end;
-                            int32_t next_left_end = left_end;
-                            if(right_end >= mspans[mspans_idx][1]) {
-                                right_end = mspans[mspans_idx][1];
-                                //if our segment is greater than the previous mate's
-                                //also increment the mate spans index
-                                //delete[] mspans[mspans_idx];
-                                mspans_idx++;
-                                if(mspans_idx < n_mspans)
-                                    next_left_end = mspans[mspans_idx][0];
-                            }
-                            else {
-                                next_left_end = mspans[mspans_idx][1];
-                            }
-                            for(z = left_end; z < right_end; z++) {
-                                coverages[z]--;
-                            }
-                            left_end = next_left_end;
+                        else {
+                            next_left_end = mspans[mspans_idx][1];
                         }
-                    }    
-                }
-                algn_end_pos += len;
+                        update_coverage(coverages, num_tracks, dec_tracks, n_dec, left_end, right_end, -1);
+                        left_end = next_left_end;
+                    }
+                }    
             }
+            algn_end_pos += len;
         }
     }
     if(mspans) {
@@ -923,88 +1056,706 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
     return algn_end_pos;
 }
 
-//typedef hashmap<std::string, std::vector<long*>*> annotation_map_t;
-//typedef hashmap<std::string, std::vector<void*>*> annotation_map_t;
-template <typename T>
-using annotation_map_t = hashmap<std::string, std::vector<T*>>;
-typedef std::vector<char*> strlist;
-//about 3x faster than the sstring/string::getline version
-template <typename T>
-static const int process_region_line(char* line, const char* delim, annotation_map_t<T>* amap, strlist* chrm_order, bool keep_order) {
-	char* tok = strtok(line, delim);
-	int i = 0;
-	char* chrm = nullptr;
-    long start = -1;
-    long end = -1;
-    int ret = 0;
-	int last_col = END_COL;
-	while(tok != nullptr) {
-		if(i > last_col)
-			break;
-		if(i == CHRM_COL) {
-			chrm = strdup(tok);
-		}
-		else if(i == START_COL)
-			start = atol(tok);
-		else if(i == END_COL)
-			end = atol(tok);
-		i++;
-		tok = strtok(nullptr, delim);
-	}
-    //if we need to keep the order, then we'll store values here
-    const int alen = keep_order?4:2;
-    T* coords = new T[alen];
-    coords[0] = start;
-    coords[1] = end;
-    std::fill(coords + 2, coords + alen, 0);
-    auto it = amap->find(chrm);
-    if(it == amap->end()) {
-        chrm_order->push_back(chrm);
-        it = amap->emplace(chrm, std::vector<T*>()).first;
-    }
-    it->second.push_back(coords);
-    return ret;
+//a whole file read-only: mmap'd where available, otherwise read into memory
+static void* map_file(const char* fn, size_t* len) {
+#ifdef WINDOWS_MINGW
+    FILE* fp = fopen(fn, "rb");
+    if(!fp)
+        return nullptr;
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    void* buf = std::malloc(*len > 0?*len:1);
+    if(fread(buf, 1, *len, fp) != *len) {
+        std::free(buf);
+        buf = nullptr;
+    }
+    fclose(fp);
+    return buf;
+#else
+    int fd = open(fn, O_RDONLY);
+    if(fd == -1)
+        return nullptr;
+    struct stat fstat_;
+    void* buf = nullptr;
+    if(fstat(fd, &fstat_) == 0 && fstat_.st_size > 0) {
+        *len = fstat_.st_size;
+        buf = mmap(nullptr, *len, PROT_READ, MAP_SHARED, fd, 0);
+        if(buf == MAP_FAILED)
+            buf = nullptr;
+    }
+    close(fd);
+    return buf;
+#endif
 }
-    
-template <typename T>
-static const int read_annotation(FILE* fin, annotation_map_t<T>* amap, strlist* chrm_order, bool keep_order) {
-    char *line = (char *)std::malloc(LINE_BUFFER_LENGTH);
-    size_t length = LINE_BUFFER_LENGTH;
-    assert(fin);
-    ssize_t bytes_read = getline(&line, &length, fin);
-    //std::fprintf(stderr, "read %zd bytes. line: '%s'\n", bytes_read, line);
+
+static void unmap_file(void* buf, size_t len) {
+#ifdef WINDOWS_MINGW
+    std::free(buf);
+#else
+    munmap(buf, len);
+#endif
+}
+
+//annotated intervals of one chromosome, kept as contiguous arrays of the distinct
+//intervals sorted by start, so repeated coordinates (e.g. exons shared between
+//transcripts) are only computed once, w/ the mapping to/from the BED rows for output
+struct ChrAnnotations {
+    std::string name;
+    //# of distinct intervals
+    uint32_t n;
+    //# of BED rows
+    uint32_t num_rows;
+    const uint32_t* starts;
+    const uint32_t* ends;
+    //distinct interval z is on BED rows rows[row_offsets[z]] .. rows[row_offsets[z+1]-1] (in BED order)
+    const uint32_t* row_offsets;
+    const uint32_t* rows;
+    //BED row -> distinct interval
+    const uint32_t* order;
+    size_t size() const { return n; }
+    uint32_t row_count(uint32_t z) const { return row_offsets[z+1] - row_offsets[z]; }
+};
+//part of the union of one --aggregate-by-name group's intervals on a chromosome
+struct GroupSegment {
+    uint32_t group;
+    uint32_t start;
+    uint32_t end;
+};
+//the --annotation BED file, chromosomes are identified by the order
+//they first appear in it, which is also the order used for keeping BED order.
+//read-only once loaded so it's shared by the BAM and BigWig paths and all threads
+struct AnnotationIndex {
+    std::vector<ChrAnnotations> chrs;
+    str2int chrm2id;
+    //backing store for the chromosomes' arrays when parsed from the BED
+    std::vector<uint32_t> storage;
+    //or the --annotation-cache file they point into
+    void* mapped = nullptr;
+    size_t mapped_len = 0;
+    //--aggregate-by-name: groups (the BED name column) in order of first appearance,
+    //their merged segments per chromosome (by ID) and total (union) lengths
+    strvec group_names;
+    std::vector<std::vector<GroupSegment>> group_segments;
+    std::vector<uint64_t> group_lengths;
+    ~AnnotationIndex() {
+        if(mapped)
+            unmap_file(mapped, mapped_len);
+    }
+    //-1 if there are no annotated intervals on the chromosome
+    int get_id(const char* chrm) const {
+        auto it = chrm2id.find(chrm);
+        return it == chrm2id.end()?-1:it->second;
+    }
+    size_t size() const { return chrs.size(); }
+    bool empty() const { return chrs.empty(); }
+    bool has_groups() const { return !group_names.empty(); }
+};
+//per annotated chromosome (by ID) results and whether the chromosome was seen
+typedef std::vector<double*> id2dblist;
+typedef std::vector<bool> id2bool;
+
+//intervals of one chromosome as they're read from the BED,
+//replaced w/ the distinct intervals & their row mappings once sorted
+struct ParsedChr {
+    std::string name;
+    std::vector<uint32_t> starts;
+    std::vector<uint32_t> ends;
+    std::vector<uint32_t> row_offsets;
+    std::vector<uint32_t> rows;
+    std::vector<uint32_t> order;
+    //group of each row w/ --aggregate-by-name
+    std::vector<uint32_t> groups;
+    std::vector<GroupSegment> segments;
+};
+
+//the chromosomes (in order of first appearance) of one chunk of the BED
+struct ParsedChunk {
+    std::vector<ParsedChr> chrs;
+    str2int chrm2id;
+    //also keep the name column as the row's group
+    bool with_names;
+    str2int name2id;
+    strvec names;
+    int err;
+};
+
+//parses one line [line, line_end) in place w/o strtok so chunks can be parsed concurrently
+//a BED coordinate has to start w/ a digit, strtol would otherwise take an empty field as 0
+//or skip leading whitespace, newlines included, into the next line
+static inline bool parse_bed_coordinate(char** field, const char* line_end, long* value) {
+    if(*field >= line_end || !isdigit((unsigned char) **field))
+        return false;
+    *value = strtol(*field, field, 10);
+    return true;
+}
+
+static const int process_region_line(char* line, char* line_end, ParsedChunk* chunk, int* last_id) {
+    //skip blank, comment, and track/browser lines
+    if(line == line_end || *line == '#' || strncmp(line, "track", 5) == 0 || strncmp(line, "browser", 7) == 0)
+        return 0;
+    char* tab = (char*) memchr(line, '\t', line_end - line);
+    if(!tab)
+        return 1;
+    char* field = tab + 1;
+    long start, end;
+    if(!parse_bed_coordinate(&field, line_end, &start) || field >= line_end || *field != '\t')
+        return 2;
+    field++;
+    if(!parse_bed_coordinate(&field, line_end, &end) || (field < line_end && *field != '\t'))
+        return 4;
+    if(chunk->with_names && field >= line_end)
+        return 3;
+    *tab = '\0';
+    char* chrm = line;
+    int group = -1;
+    if(chunk->with_names) {
+        char* name = field + 1;
+        char* name_end = (char*) memchr(name, '\t', line_end - name);
+        if(!name_end)
+            name_end = line_end;
+        *name_end = '\0';
+        auto it = chunk->name2id.find(name);
+        if(it == chunk->name2id.end()) {
+            it = chunk->name2id.emplace(name, chunk->names.size()).first;
+            chunk->names.push_back(name);
+        }
+        group = it->second;
+    }
+    //BED files are usually grouped by chromosome so only look it up when it changes
+    if(*last_id == -1 || chunk->chrs[*last_id].name != chrm) {
+        auto it = chunk->chrm2id.find(chrm);
+        if(it == chunk->chrm2id.end()) {
+            it = chunk->chrm2id.emplace(chrm, chunk->chrs.size()).first;
+            chunk->chrs.push_back(ParsedChr());
+            chunk->chrs.back().name = chrm;
+        }
+        *last_id = it->second;
+    }
+    ParsedChr& chr = chunk->chrs[*last_id];
+    chr.starts.push_back(start);
+    chr.ends.push_back(end);
+    if(group != -1)
+        chr.groups.push_back(group);
+    return 0;
+}
+
+static void parse_annotation_chunk(char* buf, char* buf_end, ParsedChunk* chunk) {
+    int last_id = -1;
+    chunk->err = 0;
+    while(buf < buf_end) {
+        char* line_end = (char*) memchr(buf, '\n', buf_end - buf);
+        if(!line_end)
+            line_end = buf_end;
+        char* next = line_end + 1;
+        if(line_end > buf && *(line_end-1) == '\r')
+            line_end--;
+        chunk->err = process_region_line(buf, line_end, chunk, &last_id);
+        if(chunk->err) {
+            if(chunk->err == 3)
+                std::cerr << "ERROR: --aggregate-by-name needs a 4th (name) column in the --annotation BED\n";
+            else
+                std::cerr << "ERROR: could not parse the --annotation BED line \"" << std::string(buf, line_end)
+                          << "\" (" << (chunk->err == 1?"no tabs":chunk->err == 2?"bad start":"bad end") << ")\n";
+            return;
+        }
+        buf = next;
+    }
+}
+
+//unions the intervals of each group on the chromosome so overlapping ones only count once
+static void merge_group_segments(ParsedChr* p) {
+    std::vector<uint32_t> rows(p->starts.size());
+    for(uint32_t i = 0; i < rows.size(); i++)
+        rows[i] = i;
+    std::sort(rows.begin(), rows.end(), [p](uint32_t a, uint32_t b) {
+                return p->groups[a] < p->groups[b] || (p->groups[a] == p->groups[b] && p->starts[a] < p->starts[b]); });
+    for(auto const i : rows) {
+        if(!p->segments.empty() && p->segments.back().group == p->groups[i] && p->starts[i] <= p->segments.back().end) {
+            p->segments.back().end = std::max(p->segments.back().end, p->ends[i]);
+            continue;
+        }
+        p->segments.push_back({p->groups[i], p->starts[i], p->ends[i]});
+    }
+    std::vector<uint32_t>().swap(p->groups);
+}
+
+//sorts & collapses the intervals of chromosomes pulled off next_chr
+static void sort_annotation_chrs(std::vector<ParsedChr>* parsed, std::atomic<int>* next_chr) {
+    int c;
+    while((c = (*next_chr)++) < parsed->size()) {
+        ParsedChr& p = (*parsed)[c];
+        const uint32_t num_rows = p.starts.size();
+        if(!p.groups.empty())
+            merge_group_segments(&p);
+        //rows sorted by coordinates, ties in BED order
+        std::vector<uint32_t>& rows = p.rows;
+        rows.resize(num_rows);
+        for(uint32_t i = 0; i < num_rows; i++)
+            rows[i] = i;
+        std::stable_sort(rows.begin(), rows.end(), [&p](uint32_t a, uint32_t b) {
+                            return p.starts[a] < p.starts[b] || (p.starts[a] == p.starts[b] && p.ends[a] < p.ends[b]); });
+        std::vector<uint32_t> starts;
+        std::vector<uint32_t> ends;
+        p.order.resize(num_rows);
+        for(uint32_t k = 0; k < num_rows; k++) {
+            const uint32_t i = rows[k];
+            if(starts.empty() || starts.back() != p.starts[i] || ends.back() != p.ends[i]) {
+                p.row_offsets.push_back(k);
+                starts.push_back(p.starts[i]);
+                ends.push_back(p.ends[i]);
+            }
+            p.order[i] = starts.size() - 1;
+        }
+        p.row_offsets.push_back(num_rows);
+        p.starts.swap(starts);
+        p.ends.swap(ends);
+    }
+}
+
+//lays out the parsed intervals in index->storage:
+//all starts, all ends, all row_offsets, all rows, then all order, each chromosome a contiguous slice
+static void build_annotation_index(std::vector<ParsedChr>* parsed, AnnotationIndex* index, int nthreads) {
+    std::atomic<int> next_chr(0);
+    std::vector<std::thread> threads;
+    for(int i = 1; i < nthreads && i < parsed->size(); i++)
+        threads.push_back(std::thread(sort_annotation_chrs, parsed, &next_chr));
+    sort_annotation_chrs(parsed, &next_chr);
+    for(auto &t: threads) t.join();
+    uint64_t num_distinct = 0;
+    uint64_t num_rows = 0;
+    for(auto const& p : *parsed) {
+        num_distinct += p.starts.size();
+        num_rows += p.rows.size();
+    }
+    index->storage.resize(2*num_distinct + (num_distinct + parsed->size()) + 2*num_rows);
+    index->group_lengths.resize(index->group_names.size(), 0);
+    uint32_t* starts = index->storage.data();
+    uint32_t* ends = starts + num_distinct;
+    uint32_t* row_offsets = ends + num_distinct;
+    uint32_t* rows = row_offsets + num_distinct + parsed->size();
+    uint32_t* order = rows + num_rows;
+    for(auto& p : *parsed) {
+        ChrAnnotations chr;
+        chr.name = p.name;
+        chr.n = p.starts.size();
+        chr.num_rows = p.rows.size();
+        std::copy(p.starts.begin(), p.starts.end(), starts);
+        std::copy(p.ends.begin(), p.ends.end(), ends);
+        std::copy(p.row_offsets.begin(), p.row_offsets.end(), row_offsets);
+        std::copy(p.rows.begin(), p.rows.end(), rows);
+        std::copy(p.order.begin(), p.order.end(), order);
+        chr.starts = starts;
+        chr.ends = ends;
+        chr.row_offsets = row_offsets;
+        chr.rows = rows;
+        chr.order = order;
+        starts += chr.n;
+        ends += chr.n;
+        row_offsets += chr.n + 1;
+        rows += chr.num_rows;
+        order += chr.num_rows;
+        index->chrs.push_back(chr);
+        if(index->has_groups()) {
+            for(auto const& seg : p.segments)
+                index->group_lengths[seg.group] += seg.end - seg.start;
+            index->group_segments.push_back(std::move(p.segments));
+        }
+        p = ParsedChr();
+    }
+}
+
+//reads the whole BED (plain, gzip, or bgzip w/ threaded decompression) through htslib
+//then splits it into chunks at line boundaries which are parsed concurrently.
+//chunks are merged in order so BED order and chromosome first appearance are kept
+static const int read_annotation(const char* fn, AnnotationIndex* index, int nthreads, bool with_names = false) {
+    BGZF* fp = bgzf_open(fn, "r");
+    if(!fp) {
+        std::cerr << "ERROR: could not open annotation " << fn << "\n";
+        return -1;
+    }
+    if(nthreads > 1 && fp->is_compressed)
+        bgzf_mt(fp, nthreads, 256);
+    std::vector<char> buf;
+    size_t len = 0;
+    ssize_t bytes_read;
+    do {
+        if(buf.size() - len < LINE_BUFFER_LENGTH)
+            buf.resize(buf.size() + std::max((size_t) LINE_BUFFER_LENGTH, buf.size()));
+        bytes_read = bgzf_read(fp, buf.data() + len, buf.size() - len);
+        if(bytes_read > 0)
+            len += bytes_read;
+    } while(bytes_read > 0);
+    bgzf_close(fp);
+    if(bytes_read < 0) {
+        std::cerr << "ERROR: could not read annotation " << fn << "\n";
+        return -1;
+    }
+    //each chunk ends on a newline (or the end of the file)
+    const int nchunks = nthreads > 1?nthreads:1;
+    std::vector<char*> bounds(1, buf.data());
+    for(int i = 1; i < nchunks; i++) {
+        char* b = std::max(bounds.back(), buf.data() + (len*i)/nchunks);
+        char* nl = (char*) memchr(b, '\n', (buf.data() + len) - b);
+        bounds.push_back(nl?nl+1:buf.data() + len);
+    }
+    bounds.push_back(buf.data() + len);
+    std::vector<ParsedChunk> chunks(nchunks);
+    for(auto& chunk : chunks)
+        chunk.with_names = with_names;
+    std::vector<std::thread> threads;
+    for(int i = 1; i < nchunks; i++)
+        threads.push_back(std::thread(parse_annotation_chunk, bounds[i], bounds[i+1], &chunks[i]));
+    parse_annotation_chunk(bounds[0], bounds[1], &chunks[0]);
+    for(auto &t: threads) t.join();
     int err = 0;
-    while(bytes_read != -1) {
-        err = process_region_line(line, "\t", amap, chrm_order, keep_order);
-        if(err) {
-            std::cerr << "Error: " << err << " in process_region_line.\n";
-            break;
+    std::vector<ParsedChr> parsed;
+    str2int group2id;
+    for(auto& chunk : chunks) {
+        if(chunk.err)
+            err = chunk.err;
+        //chunk local group IDs to global ones
+        std::vector<uint32_t> chunk2group;
+        for(auto const& name : chunk.names) {
+            auto it = group2id.find(name);
+            if(it == group2id.end()) {
+                it = group2id.emplace(name, index->group_names.size()).first;
+                index->group_names.push_back(name);
+            }
+            chunk2group.push_back(it->second);
+        }
+        for(auto& chr : chunk.chrs) {
+            for(auto& g : chr.groups)
+                g = chunk2group[g];
+            auto it = index->chrm2id.find(chr.name);
+            if(it == index->chrm2id.end()) {
+                it = index->chrm2id.emplace(chr.name, parsed.size()).first;
+                parsed.push_back(ParsedChr());
+                parsed.back().name = chr.name;
+            }
+            ParsedChr& p = parsed[it->second];
+            if(p.starts.empty()) {
+                p.starts.swap(chr.starts);
+                p.ends.swap(chr.ends);
+                p.groups.swap(chr.groups);
+            }
+            else {
+                p.starts.insert(p.starts.end(), chr.starts.begin(), chr.starts.end());
+                p.ends.insert(p.ends.end(), chr.ends.begin(), chr.ends.end());
+                p.groups.insert(p.groups.end(), chr.groups.begin(), chr.groups.end());
+            }
         }
-        assert(err==0);
-        bytes_read = getline(&line, &length, fin);
     }
-    std::free(line);
+    if(err)
+        return err;
+    std::vector<char>().swap(buf);
+    build_annotation_index(&parsed, index, nthreads);
     std::cerr << "building whole annotation region map done\n";
     return err;
 }
 
+//--annotation-cache: the AnnotationIndex compiled to a binary file which is mmap'd w/o any parsing
+//(and so shared between processes on the same node).  All little-endian:
+//  AnnotationCacheHeader
+//  num_chrs AnnotationCacheChr
+//  starts, ends (num_distinct uint32_t's each), row_offsets (num_distinct + num_chrs),
+//  rows, order (num_rows each), w/ each chromosome a contiguous slice of each, in order
+//  chromosome names
+//it's rebuilt if the BED file's size or modification time change
+static const char ANNOTATION_CACHE_MAGIC[8] = {'M','D','A','N','N','O','T','C'};
+static const uint32_t ANNOTATION_CACHE_VERSION = 2;
+struct AnnotationCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_chrs;
+    uint64_t num_distinct;
+    uint64_t num_rows;
+    uint64_t bed_size;
+    int64_t bed_mtime;
+    //of everything after the header
+    uint64_t checksum;
+};
+struct AnnotationCacheChr {
+    uint64_t name_offset;
+    uint32_t name_len;
+    uint32_t n;
+    uint32_t num_rows;
+    uint32_t unused;
+    //offsets of the chromosome's first distinct interval & first row
+    uint64_t first;
+    uint64_t first_row;
+};
+
+static uint64_t checksum_buffer(const uint8_t* buf, uint64_t len) {
+    //FNV-1a over 8 byte words
+    uint64_t h = 14695981039346656037ULL;
+    uint64_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, buf + i, 8);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    for(; i < len; i++)
+        h = (h ^ buf[i]) * 1099511628211ULL;
+    return h;
+}
+
+//0 if the cache was loaded, otherwise it's missing, stale, or corrupt
+static int load_annotation_cache(const char* cache_fn, const struct stat* bed_stat, AnnotationIndex* index) {
+    size_t len = 0;
+    void* mapped = map_file(cache_fn, &len);
+    if(!mapped)
+        return -1;
+    const uint8_t* buf = (const uint8_t*) mapped;
+    const AnnotationCacheHeader* header = (const AnnotationCacheHeader*) buf;
+    if(len < sizeof(AnnotationCacheHeader) || memcmp(header->magic, ANNOTATION_CACHE_MAGIC, 8) != 0
+            || header->version != ANNOTATION_CACHE_VERSION || header->bed_size != (uint64_t) bed_stat->st_size
+            || header->bed_mtime != (int64_t) bed_stat->st_mtime) {
+        unmap_file(mapped, len);
+        return -1;
+    }
+    const uint64_t num_distinct = header->num_distinct;
+    const uint64_t num_rows = header->num_rows;
+    const uint64_t arrays_offset = sizeof(AnnotationCacheHeader) + header->num_chrs*sizeof(AnnotationCacheChr);
+    const uint64_t names_offset = arrays_offset + (3*num_distinct + header->num_chrs + 2*num_rows)*sizeof(uint32_t);
+    if(len < names_offset || checksum_buffer(buf + sizeof(AnnotationCacheHeader), len - sizeof(AnnotationCacheHeader)) != header->checksum) {
+        fprintf(stderr, "WARNING: annotation cache %s is corrupt, rebuilding it\n", cache_fn);
+        unmap_file(mapped, len);
+        return -1;
+    }
+    const AnnotationCacheChr* cchrs = (const AnnotationCacheChr*) (buf + sizeof(AnnotationCacheHeader));
+    const uint32_t* starts = (const uint32_t*) (buf + arrays_offset);
+    const uint32_t* ends = starts + num_distinct;
+    const uint32_t* row_offsets = ends + num_distinct;
+    const uint32_t* rows = row_offsets + num_distinct + header->num_chrs;
+    const uint32_t* order = rows + num_rows;
+    for(uint32_t i = 0; i < header->num_chrs; i++) {
+        ChrAnnotations chr;
+        chr.name = std::string((const char*) (buf + names_offset + cchrs[i].name_offset), cchrs[i].name_len);
+        chr.n = cchrs[i].n;
+        chr.num_rows = cchrs[i].num_rows;
+        chr.starts = starts + cchrs[i].first;
+        chr.ends = ends + cchrs[i].first;
+        chr.row_offsets = row_offsets + cchrs[i].first + i;
+        chr.rows = rows + cchrs[i].first_row;
+        chr.order = order + cchrs[i].first_row;
+        index->chrm2id.emplace(chr.name, i);
+        index->chrs.push_back(chr);
+    }
+    index->mapped = mapped;
+    index->mapped_len = len;
+    return 0;
+}
+
+//written to a temporary file first so concurrent jobs never map a partial cache
+static int write_annotation_cache(const char* cache_fn, const struct stat* bed_stat, const AnnotationIndex* index) {
+    std::string names;
+    std::vector<AnnotationCacheChr> cchrs;
+    uint64_t num_distinct = 0;
+    uint64_t num_rows = 0;
+    for(auto const& chr : index->chrs) {
+        cchrs.push_back({names.size(), (uint32_t) chr.name.size(), chr.n, chr.num_rows, 0, num_distinct, num_rows});
+        names += chr.name;
+        num_distinct += chr.n;
+        num_rows += chr.num_rows;
+    }
+    std::vector<uint8_t> body(cchrs.size()*sizeof(AnnotationCacheChr)
+                              + (3*num_distinct + cchrs.size() + 2*num_rows)*sizeof(uint32_t) + names.size());
+    uint8_t* bp = body.data();
+    if(!cchrs.empty())
+        memcpy(bp, cchrs.data(), cchrs.size()*sizeof(AnnotationCacheChr));
+    bp += cchrs.size()*sizeof(AnnotationCacheChr);
+    for(int a = 0; a < 5; a++) {
+        for(auto const& chr : index->chrs) {
+            const uint32_t* arrs[5] = { chr.starts, chr.ends, chr.row_offsets, chr.rows, chr.order };
+            const size_t lens[5] = { chr.n, chr.n, chr.n + 1, chr.num_rows, chr.num_rows };
+            memcpy(bp, arrs[a], lens[a]*sizeof(uint32_t));
+            bp += lens[a]*sizeof(uint32_t);
+        }
+    }
+    memcpy(bp, names.data(), names.size());
+    AnnotationCacheHeader header;
+    memcpy(header.magic, ANNOTATION_CACHE_MAGIC, 8);
+    header.version = ANNOTATION_CACHE_VERSION;
+    header.num_chrs = cchrs.size();
+    header.num_distinct = num_distinct;
+    header.num_rows = num_rows;
+    header.bed_size = bed_stat->st_size;
+    header.bed_mtime = bed_stat->st_mtime;
+    header.checksum = checksum_buffer(body.data(), body.size());
+    char tmp_fn[1024];
+    sprintf(tmp_fn, "%s.%d.tmp", cache_fn, (int) getpid());
+    FILE* cfp = fopen(tmp_fn, "wb");
+    if(!cfp) {
+        fprintf(stderr, "WARNING: could not write annotation cache %s\n", cache_fn);
+        return -1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, cfp) == 1 && fwrite(body.data(), 1, body.size(), cfp) == body.size();
+    ok = (fclose(cfp) == 0) && ok;
+    if(!ok || rename(tmp_fn, cache_fn) != 0) {
+        fprintf(stderr, "WARNING: could not write annotation cache %s\n", cache_fn);
+        remove(tmp_fn);
+        return -1;
+    }
+    return 0;
+}
+
+//--sums-binary file layout (all little-endian):
+//  SumsBinaryHeader
+//  the sample ID (id_len bytes, 0 padded to a multiple of 8 so the values are aligned for mmap'ing)
+//  num_values values (of the first op), one per BED row in its order: doubles (SUMS_FLOAT64)
+//  or the rounded values' deltas from the previous one, zigzag & LEB128 varint encoded (SUMS_DELTA_VARINT)
+static const char SUMS_BINARY_MAGIC[8] = {'M','D','S','U','M','S','0','1'};
+struct SumsBinaryHeader {
+    char magic[8];
+    uint32_t encoding;
+    uint32_t id_len;
+    uint64_t num_values;
+    //of the annotation (see annotation_checksum) so sums over different BEDs aren't added together
+    uint64_t annotation_checksum;
+};
+
+//of the annotation's BED rows in order (chromosome names, starts & ends)
+static uint64_t annotation_checksum(const AnnotationIndex* index) {
+    std::vector<uint8_t> body;
+    for(auto const& ants : index->chrs) {
+        body.insert(body.end(), ants.name.begin(), ants.name.end());
+        for(uint32_t i = 0; i < ants.num_rows; i++) {
+            const uint32_t coords[2] = { ants.starts[ants.order[i]], ants.ends[ants.order[i]] };
+            body.insert(body.end(), (const uint8_t*) coords, (const uint8_t*) (coords + 2));
+        }
+    }
+    return checksum_buffer(body.data(), body.size());
+}
+
+enum Op { csum, cmean, cmin, cmax, cmedian, cbases };
+//statistics to output per annotated interval, one column each
+typedef std::vector<Op> op_list;
+
+//one column per op (w/o the coordinates w/ --sums-only),
+//BAM coverage (T=long) only gets decimals for means & medians
+template <typename T>
+static void print_stats(FILE* afp, const char* c, long start, long end, const double* vals, const op_list& ops) {
+    if(!SUMS_ONLY)
+        fprintf(afp, "%s\t%lu\t%lu", c, start, end);
+    for(int k = 0; k < ops.size(); k++) {
+        const char* sep = (k > 0 || !SUMS_ONLY)?"\t":"";
+        if(std::is_same<T, long>::value && ops[k] != cmean && ops[k] != cmedian)
+            fprintf(afp, "%s%lu", sep, (long) vals[k]);
+        else
+            fprintf(afp, "%s%.3f", sep, vals[k]);
+    }
+    fprintf(afp, "\n");
+}
+
+//median of an interval's coverages (reordered in place), the mean of the middle two for an even count
+static double median_coverage(std::vector<uint32_t>* covs) {
+    if(covs->empty())
+        return 0.0;
+    const size_t mid = covs->size() / 2;
+    std::nth_element(covs->begin(), covs->begin() + mid, covs->end());
+    double median = (*covs)[mid];
+    if(covs->size() % 2 == 0)
+        median = (median + *std::max_element(covs->begin(), covs->begin() + mid)) / 2.0;
+    return median;
+}
+
 template <typename T>
-static void sum_annotations(const uint32_t* coverages, const std::vector<T*>& annotations, const long chr_size, const char* chrm, FILE* ofp, uint64_t* annotated_auc, bool just_auc = false, int keep_order_idx = -1) {
+//computes the ops over each annotated interval from one pass over its interleaved coverage,
+//printing them to afps (one per track) unless they're stored in vals_out ((z*num_tracks + t)*ops.size() + op);
+//the annotated AUCs are only added up when tracks is passed in
+static void sum_annotations(const uint32_t* coverages, const int num_tracks, const ChrAnnotations& annotations, const long chr_size, const op_list& ops,
+                            coverage_tracks* tracks, FILE** afps, double* vals_out = nullptr) {
     unsigned long z, j;
+    int t;
+    const int num_ops = ops.size();
+    const bool print_now = !vals_out;
+    const char* chrm = annotations.name.c_str();
+    const uint32_t* starts = annotations.starts;
+    const uint32_t* ends = annotations.ends;
+    //the default only needs the sums
+    const bool just_sums = num_ops == 1 && ops[0] == csum;
+    const bool medians = std::find(ops.begin(), ops.end(), cmedian) != ops.end();
+    //when printing, hold the values so each track's output stays contiguous
+    std::vector<double> held_vals;
+    if(print_now) {
+        held_vals.resize(annotations.size()*num_tracks*num_ops);
+        vals_out = held_vals.data();
+    }
+    std::vector<T> sums(num_tracks);
+    std::vector<uint32_t> mins(num_tracks);
+    std::vector<uint32_t> maxs(num_tracks);
+    std::vector<uint32_t> bases(num_tracks);
+    std::vector<std::vector<uint32_t>> covs(medians?num_tracks:0);
     for(z = 0; z < annotations.size(); z++) {
-        T sum = 0;
-        T start = annotations[z][0];
-        T end = annotations[z][1];
-        for(j = start; j < end; j++) {
-            assert(j < chr_size);
-            sum += coverages[j];
-        }
-        (*annotated_auc) = (*annotated_auc) + sum;
-        if(!just_auc) {
-            if(keep_order_idx == -1)
-                print_shared(ofp, chrm, (long) start, (long) end, sum, nullptr, 0);
-            else
-                annotations[z][keep_order_idx] = sum;
+        std::fill(sums.begin(), sums.end(), 0);
+        const uint32_t start = starts[z];
+        const uint32_t end = ends[z];
+        if(just_sums) {
+            for(j = start; j < end; j++) {
+                assert(j < chr_size);
+                const uint32_t* pos_covs = coverages + j*num_tracks;
+                for(t = 0; t < num_tracks; t++)
+                    sums[t] += pos_covs[t];
+            }
+        }
+        else {
+            std::fill(mins.begin(), mins.end(), end > start?UINT32_MAX:0);
+            std::fill(maxs.begin(), maxs.end(), 0);
+            std::fill(bases.begin(), bases.end(), 0);
+            for(auto& tcovs : covs)
+                tcovs.clear();
+            for(j = start; j < end; j++) {
+                assert(j < chr_size);
+                const uint32_t* pos_covs = coverages + j*num_tracks;
+                for(t = 0; t < num_tracks; t++) {
+                    const uint32_t cov = pos_covs[t];
+                    sums[t] += cov;
+                    mins[t] = cov < mins[t]?cov:mins[t];
+                    maxs[t] = cov > maxs[t]?cov:maxs[t];
+                    bases[t] += cov >= BASES_MIN_COVERAGE;
+                    if(medians)
+                        covs[t].push_back(cov);
+                }
+            }
+        }
+        //duplicated intervals still count once per BED row
+        const uint32_t nrows = annotations.row_count(z);
+        for(t = 0; t < num_tracks; t++) {
+            if(tracks)
+                (*tracks)[t].annotated_auc += sums[t]*nrows;
+            double* vals = vals_out + (z*num_tracks + t)*num_ops;
+            for(int k = 0; k < num_ops; k++) {
+                switch(ops[k]) {
+                    case csum:
+                        vals[k] = sums[t];
+                        break;
+                    case cmean:
+                        vals[k] = end > start?(double) sums[t] / (end - start):0.0;
+                        break;
+                    case cmin:
+                        vals[k] = mins[t];
+                        break;
+                    case cmax:
+                        vals[k] = maxs[t];
+                        break;
+                    case cmedian:
+                        vals[k] = median_coverage(&covs[t]);
+                        break;
+                    case cbases:
+                        vals[k] = bases[t];
+                        break;
+                }
+            }
+        }
+    }
+    //in the chromosome's BED row order, duplicated intervals once per row
+    if(print_now) {
+        for(t = 0; t < num_tracks; t++) {
+            for(uint32_t r = 0; r < annotations.num_rows; r++) {
+                z = annotations.order[r];
+                print_stats<T>(afps[t], chrm, (long) starts[z], (long) ends[z], vals_out + (z*num_tracks + t)*num_ops, ops);
+            }
         }
     }
 }
@@ -1076,13 +1827,46 @@ void output_read_sequence_and_qualities(char* qname, int midx, uint8_t* seq, uin
 }
 
 
-static int process_bigwig_for_total_auc(const char* fn, double* all_auc, FILE* errfp = stderr) {
-    //in part lifted from https://github.com/dpryan79/libBigWig/blob/master/test/testIterator.c
-    //this is the buffer
+//sums every chromosome from the BigWig's zoom level records (bwStats picks the level),
+//false if it has no zoom levels to use
+static bool bigwig_auc_from_zooms(bigWigFile_t* fp, double* all_auc) {
+    if(fp->hdr->nLevels == 0)
+        return false;
+    for(uint32_t tid = 0; tid < fp->cl->nKeys; tid++) {
+        if(fp->cl->len[tid] < 1)
+            continue;
+        double* chr_sum = bwStats(fp, fp->cl->chrom[tid], 0, fp->cl->len[tid], 1, sum);
+        if(!chr_sum)
+            return false;
+        //NaN for chromosomes w/o any data
+        if(!std::isnan(*chr_sum))
+            (*all_auc) += *chr_sum;
+        free(chr_sum);
+    }
+    return true;
+}
+
+//smallest read buffer per remote BigWig when the default's divided up between the threads
+static const uint32_t MIN_BW_READ_BUFFER = 1<<24;
+
+//libBigWig's setup (curl's global state & the read buffer size for remote BigWigs) is process wide
+//and not thread safe, so it's done once before any threads start & cleaned up once they're all done.
+//each thread opens its own files; w/o --bwbuffer the default buffer is split between them
+//to keep the memory bounded at high thread counts (local BigWigs don't use it)
+static int init_bigwig_reader(int nthreads, bool buffer_set, FILE* errfp = stderr) {
+    if(!buffer_set && nthreads > 1)
+        BW_READ_BUFFER = std::max(MIN_BW_READ_BUFFER, default_BW_READ_BUFFER / nthreads);
     if(bwInit(BW_READ_BUFFER) != 0) {
         fprintf(errfp, "Error in bwInit, exiting\n");
         return -1;
     }
+    return 0;
+}
+
+//unless exact is set the AUC comes from the BigWig's total summary in its header (sumData)
+//or failing that its zoom levels, only reading every interval when neither are there
+static int process_bigwig_for_total_auc(const char* fn, double* all_auc, bool exact = false, FILE* errfp = stderr) {
+    //in part lifted from https://github.com/dpryan79/libBigWig/blob/master/test/testIterator.c
     bigWigFile_t *fp = bwOpen((char *)fn, NULL, "r");
     if(!fp) {
         fprintf(errfp, "Error in opening %s as BigWig file, exiting\n", fn);
@@ -1090,6 +1874,18 @@ static int process_bigwig_for_total_auc(const char* fn, double* all_auc, FILE* e
     }
     fprintf(stdout,"opened %s, BW read buffer is %u\n",fn, BW_READ_BUFFER);
     fflush(stdout);
+    if(!exact && fp->hdr->summaryOffset != 0) {
+        (*all_auc) = fp->hdr->sumData;
+        fprintf(errfp, "AUC from the header summary of %s\n", fn);
+        bwClose(fp);
+        return 0;
+    }
+    if(!exact && bigwig_auc_from_zooms(fp, all_auc)) {
+        fprintf(errfp, "AUC from the zoom levels of %s\n", fn);
+        bwClose(fp);
+        return 0;
+    }
+    (*all_auc) = 0.0;
     uint32_t i, tid, blocksPerIteration;
     //better to ask for a few blocks for better memory and time stats
     blocksPerIteration = 10;
@@ -1130,209 +1926,549 @@ static int process_bigwig_for_total_auc(const char* fn, double* all_auc, FILE* e
     }
 
     bwClose(fp);
-    bwCleanup();
     return 0;
 }
 
 
-using chr2bool = hashset<std::string>;
-enum Op { csum, cmean, cmin, cmax };
 typedef hashmap<std::string, int> str2op;
-template <typename T>
-static int process_bigwig(const char* fn, double* annotated_auc, annotation_map_t<T>* amap, chr2bool* annotation_chrs_seen, FILE* afp, int keep_order_idx = -1, Op op = csum, FILE* errfp = stderr, str2dblist* store_local=nullptr) {
-    //in part lifted from https://github.com/dpryan79/libBigWig/blob/master/test/testIterator.c
-    if(bwInit(BW_READ_BUFFER) != 0) {
-        fprintf(errfp, "Error in bwInit, exiting\n");
-        return -1;
-    }
-    bigWigFile_t *fp = bwOpen((char *)fn, NULL, "r");
-    if(!fp) {
-        fprintf(errfp, "Error in opening %s as BigWig file, exiting\n", fn);
+
+//one --annotation BED, all are summed from the same pass over the input
+struct AnnotationSet {
+    AnnotationIndex index;
+    //empty keeps the default output names (e.g. <prefix>.annotation.tsv)
+    std::string label;
+    op_list ops;
+    //where the input's (first) coverage track is written
+    FILE* afp;
+};
+typedef std::vector<AnnotationSet*> annotation_sets;
+
+//one annotation set's results for a BigWig
+struct AnnotationTarget {
+    const AnnotationSet* set;
+    FILE* afp;
+    double annotated_auc;
+    id2bool chrs_seen;
+    //values by annotation chromosome ID when keeping the BED order
+    id2dblist store_local;
+    AnnotationTarget(const AnnotationSet* set_, FILE* afp_) :
+        set(set_), afp(afp_), annotated_auc(0.0), chrs_seen(set_->index.size(), false), store_local(set_->index.size(), nullptr) { }
+};
+
+//median of an annotated interval's BigWig values given as (value, # of bases) runs (reordered in place)
+//covering num_bases in all, the mean of the middle two for an even count
+static double median_of_runs(std::vector<std::pair<double, uint32_t>>* runs, const uint64_t num_bases) {
+    if(num_bases == 0)
+        return 0.0;
+    std::sort(runs->begin(), runs->end());
+    const uint64_t lo = (num_bases - 1) / 2;
+    const uint64_t hi = num_bases / 2;
+    double lo_val = 0.0;
+    uint64_t seen = 0;
+    for(auto const& run : *runs) {
+        if(seen <= lo && lo < seen + run.second)
+            lo_val = run.first;
+        if(hi < seen + run.second)
+            return (lo_val + run.first) / 2.0;
+        seen += run.second;
+    }
+    return lo_val;
+}
+
+//--approximate: whether an annotated interval is summarized from the zoom levels rather than the base level intervals
+static inline bool approximated(const uint32_t start, const uint32_t end) {
+    return APPROXIMATE_MIN_LENGTH > 0 && end - start >= APPROXIMATE_MIN_LENGTH;
+}
+
+//the sum (and min/max) of an annotated interval from the BigWig's zoom level records
+//(bwStats picks the coarsest level still finer than the interval), left as is when there's no data
+static void bigwig_zoom_stats(bigWigFile_t* fp, const char* chrm, const uint32_t start, const uint32_t end, const bool min_max,
+                              double* sum_out, double* min_out, double* max_out) {
+    const bwStatsType types[] = { sum, min, max };
+    double* outs[] = { sum_out, min_out, max_out };
+    for(int i = 0; i < (min_max?3:1); i++) {
+        double* val = bwStats(fp, (char*) chrm, start, end, 1, types[i]);
+        if(val && !std::isnan(*val))
+            *(outs[i]) = *val;
+        free(val);
+    }
+}
+
+//the ops (into vals) over one annotated interval from a BigWig's intervals on its chromosome, returning its sum.
+//first_j is the first of the BigWig's intervals which can still overlap this or a later annotated interval:
+//the annotated intervals are sorted by start (see AnnotationIndex) and the BigWig's intervals don't overlap,
+//so it only ever moves forward and each overlap, having one value, is applied in O(1).
+//runs is scratch space for the median
+static double bigwig_interval_stats(bigWigFile_t* fp, const bwOverlappingIntervals_t* intervals, long* first_j, const char* chrm,
+                                    const uint32_t start, const uint32_t end, const op_list& ops,
+                                    std::vector<std::pair<double, uint32_t>>* runs, double* vals) {
+    const bool medians = std::find(ops.begin(), ops.end(), cmedian) != ops.end();
+    const bool min_max = std::find(ops.begin(), ops.end(), cmin) != ops.end() || std::find(ops.begin(), ops.end(), cmax) != ops.end();
+    const uint32_t* istarts = intervals->start;
+    const uint32_t* iends = intervals->end;
+    const float* ivalues = intervals->value;
+    const long num_intervals = intervals->l;
+    double sum = 0;
+    double min = std::numeric_limits<double>::max();
+    double max = 0;
+    uint64_t bases = 0;
+    uint64_t covered = 0;
+    runs->clear();
+    //these weren't fetched at the base level (no median or bases w/ --approximate)
+    if(approximated(start, end)) {
+        bigwig_zoom_stats(fp, chrm, start, end, min_max, &sum, &min, &max);
+        covered = end - start;
+    }
+    else {
+        while(*first_j < num_intervals && iends[*first_j] <= start)
+            (*first_j)++;
+        for(long j = *first_j; j < num_intervals && istarts[j] < end; j++) {
+            const uint32_t len = (iends[j] < end?iends[j]:end) - (istarts[j] > start?istarts[j]:start);
+            const double value = ivalues[j];
+            sum += value*len;
+            min = value < min ? value:min;
+            max = value > max ? value:max;
+            if(value >= BASES_MIN_COVERAGE)
+                bases += len;
+            covered += len;
+            if(medians)
+                runs->push_back(std::make_pair(value, len));
+        }
+    }
+    //0-based start
+    double annot_length = end - start;
+    //bases w/o a BigWig interval count as 0's
+    const uint64_t uncovered = (uint64_t) annot_length - covered;
+    //including for the min (also when the zoom levels had nothing there)
+    if(uncovered > 0 || covered == 0 || min == std::numeric_limits<double>::max())
+        min = 0.0;
+    if(0.0 >= BASES_MIN_COVERAGE)
+        bases += uncovered;
+    if(medians && uncovered > 0)
+        runs->push_back(std::make_pair(0.0, (uint32_t) uncovered));
+    for(int o = 0; o < ops.size(); o++) {
+        switch(ops[o]) {
+            case csum:
+                vals[o] = sum;
+                break;
+            case cmean:
+                vals[o] = (double)sum / (double)annot_length;
+                break;
+            case cmin:
+                vals[o] = min;
+                break;
+            case cmax:
+                vals[o] = max;
+                break;
+            case cmedian:
+                vals[o] = median_of_runs(runs, (uint64_t) annot_length);
+                break;
+            case cbases:
+                vals[o] = bases;
+                break;
+        }
+    }
+    return sum;
+}
+
+//applies all of the annotation's ops to the BigWig intervals of one chromosome over each annotated interval
+//in a single sweep, storing them in the target's store_local (ops.size() per interval) when keeping the BED order
+template <typename T>
+static void sum_bigwig_annotations(bigWigFile_t* fp, const bwOverlappingIntervals_t* intervals, const char* chrm, const ChrAnnotations& annotations, const int chr_id,
+                                   AnnotationTarget* target, bool keep_order, double* annotated_auc) {
+    const op_list& ops = target->set->ops;
+    const int num_ops = ops.size();
+    const bool sum_auc = std::find(ops.begin(), ops.end(), csum) != ops.end();
+    long z;
+    long first_j = 0;
+    long asz = annotations.size();
+    double* local_vals = nullptr;
+    //when printing, hold the chromosome's values so its rows come out in BED order
+    std::vector<double> held_vals;
+    //(value, length) of the BigWig intervals overlapping the annotated interval for its median
+    std::vector<std::pair<double, uint32_t>> runs;
+    //don't want to reallocate for every new bigwig file in list mode, so
+    //we allocate once per thread per chromosome
+    if(keep_order) {
+        if(!target->store_local[chr_id])
+            target->store_local[chr_id] = new double[asz*num_ops];
+        local_vals = target->store_local[chr_id];
+    }
+    else {
+        held_vals.resize(asz*num_ops);
+        local_vals = held_vals.data();
+    }
+    std::fill(local_vals, local_vals + asz*num_ops, 0.);
+    for(z = 0; z < asz; z++) {
+        const double sum = bigwig_interval_stats(fp, intervals, &first_j, chrm, annotations.starts[z], annotations.ends[z], ops, &runs, local_vals + z*num_ops);
+        //duplicated intervals still count once per BED row
+        if(sum_auc)
+            (*annotated_auc) += sum*annotations.row_count(z);
+    }
+    //not trying to keep the order across the BED file, just print the chromosome's rows as we finish it
+    if(!keep_order) {
+        for(uint32_t r = 0; r < annotations.num_rows; r++) {
+            z = annotations.order[r];
+            print_stats<T>(target->afp, chrm, (long) annotations.starts[z], (long) annotations.ends[z], local_vals + z*num_ops, ops);
+        }
+    }
+}
+
+//gaps between annotated intervals up to this long are read through rather than starting another BigWig query
+static const uint64_t BW_CLUSTER_GAP = 1<<16;
+//the whole chromosome is fetched instead once the clusters span more than 1/BW_SPARSE_FRACTION of it
+//or there are more than BW_MAX_CLUSTERS of them
+static const uint64_t BW_SPARSE_FRACTION = 4;
+static const size_t BW_MAX_CLUSTERS = 4096;
+typedef std::vector<std::pair<uint32_t, uint32_t>> interval_list;
+
+//merges the annotated intervals of all the targets w/ the chromosome into clusters to query the BigWig for,
+//false if they're dense enough that reading the whole chromosome is cheaper
+static bool cluster_annotations(const std::vector<AnnotationTarget>* targets, const int* chr_ids, const uint32_t chr_len, interval_list* clusters) {
+    interval_list ivls;
+    int num_sets = 0;
+    for(int s = 0; s < targets->size(); s++) {
+        if(chr_ids[s] == -1)
+            continue;
+        const ChrAnnotations& ants = (*targets)[s].set->index.chrs[chr_ids[s]];
+        for(uint32_t z = 0; z < ants.size(); z++) {
+            //those come from the zoom levels
+            if(!approximated(ants.starts[z], ants.ends[z]))
+                ivls.push_back(std::make_pair(ants.starts[z], ants.ends[z]));
+        }
+        num_sets++;
+    }
+    //each set's intervals are already sorted by start
+    if(num_sets > 1)
+        std::sort(ivls.begin(), ivls.end());
+    uint64_t span = 0;
+    for(auto const& ivl : ivls) {
+        if(clusters->empty() || ivl.first > (uint64_t) clusters->back().second + BW_CLUSTER_GAP) {
+            if(!clusters->empty())
+                span += clusters->back().second - clusters->back().first;
+            if(clusters->size() == BW_MAX_CLUSTERS)
+                return false;
+            clusters->push_back(ivl);
+        }
+        else if(ivl.second > clusters->back().second)
+            clusters->back().second = ivl.second;
+    }
+    if(!clusters->empty())
+        span += clusters->back().second - clusters->back().first;
+    return span * BW_SPARSE_FRACTION < chr_len;
+}
+
+//queries the BigWig (via its R-tree index) for each cluster, so only the data blocks overlapping them are read,
+//and concatenates the intervals in order (an interval overlapping 2 clusters is only kept once)
+static bwOverlappingIntervals_t* fetch_bigwig_clusters(bigWigFile_t* fp, char* chrm, const interval_list& clusters, const char* fn, FILE* errfp) {
+    bwOverlappingIntervals_t* all = (bwOverlappingIntervals_t*) calloc(1, sizeof(bwOverlappingIntervals_t));
+    for(auto const& cluster : clusters) {
+        bwOverlappingIntervals_t* o = bwGetOverlappingIntervals(fp, chrm, cluster.first, cluster.second);
+        //an empty region comes back w/ 0 intervals, so this is a failed (e.g. remote) read
+        if(!o) {
+            fprintf(errfp, "WARNING: failed to read the intervals of %s:%u-%u in %s as BigWig file, its annotated regions there will have 0 coverage\n",
+                    chrm, cluster.first, cluster.second, fn);
+            continue;
+        }
+        for(uint32_t i = 0; i < o->l; i++) {
+            if(all->l > 0 && o->start[i] < all->end[all->l - 1])
+                continue;
+            if(all->l == all->m) {
+                all->m = all->m > 0?all->m*2:1024;
+                all->start = (uint32_t*) realloc(all->start, all->m*sizeof(uint32_t));
+                all->end = (uint32_t*) realloc(all->end, all->m*sizeof(uint32_t));
+                all->value = (float*) realloc(all->value, all->m*sizeof(float));
+            }
+            all->start[all->l] = o->start[i];
+            all->end[all->l] = o->end[i];
+            all->value[all->l] = o->value[i];
+            all->l++;
+        }
+        bwDestroyOverlappingIntervals(o);
+    }
+    return all;
+}
+
+//the BigWig's intervals on one chromosome, only around the clusters when sparse (see cluster_annotations);
+//iter is set when the whole chromosome was read (see release_bigwig_chromosome). nullptr if it has no intervals there
+static bwOverlappingIntervals_t* fetch_bigwig_chromosome(bigWigFile_t* fp, const uint32_t tid, const char* fn, const interval_list& clusters, bool sparse,
+                                                         bwOverlapIterator_t** iter, FILE* errfp) {
+    *iter = nullptr;
+    if(sparse) {
+        bwOverlappingIntervals_t* intervals = fetch_bigwig_clusters(fp, fp->cl->chrom[tid], clusters, fn, errfp);
+        //w/ --approximate there may be nothing to read at the base level
+        if(intervals->l > 0 || clusters.empty())
+            return intervals;
+        bwDestroyOverlappingIntervals(intervals);
+    }
+    else {
+        //ask for huge # of blocks per chromosome to ensure we get all in one go
+        //(this is for convenience, not performance)
+        const uint32_t blocksPerIteration = 4000000;
+        *iter = bwOverlappingIntervalsIterator(fp, fp->cl->chrom[tid], 0, fp->cl->len[tid], blocksPerIteration);
+        if(!(*iter)->data)
+        {
+            fprintf(errfp, "WARNING: no interval data for chromosome %s in %s as BigWig file, skipping\n", fp->cl->chrom[tid], fn);
+            bwIteratorDestroy(*iter);
+            *iter = nullptr;
+            return nullptr;
+        }
+        if((*iter)->intervals->l > 0)
+            return (*iter)->intervals;
+        bwIteratorDestroy(*iter);
+        *iter = nullptr;
+    }
+    fprintf(errfp, "WARNING: 0 intervals for chromosome %s in %s as BigWig file, skipping\n", fp->cl->chrom[tid], fn);
+    return nullptr;
+}
+
+static void release_bigwig_chromosome(bwOverlappingIntervals_t* intervals, bwOverlapIterator_t* iter) {
+    if(iter)
+        bwIteratorDestroy(iter);
+    else if(intervals)
+        bwDestroyOverlappingIntervals(intervals);
+}
+
+//fetches one chromosome's intervals and applies each annotation set w/ an ID for it (chr_ids, one per target) to them,
+//adding the sets' annotated AUCs for the chromosome to aucs; false if the BigWig has no intervals for it.
+//sparse annotations only fetch the parts of the chromosome around them
+template <typename T>
+static bool process_bigwig_chromosome(bigWigFile_t* fp, const uint32_t tid, const char* fn, std::vector<AnnotationTarget>* targets,
+                                      const int* chr_ids, bool keep_order, double* aucs, FILE* errfp) {
+    interval_list clusters;
+    bwOverlapIterator_t* iter = nullptr;
+    const bool sparse = cluster_annotations(targets, chr_ids, fp->cl->len[tid], &clusters);
+    bwOverlappingIntervals_t* intervals = fetch_bigwig_chromosome(fp, tid, fn, clusters, sparse, &iter, errfp);
+    if(!intervals)
+        return false;
+    for(int s = 0; s < targets->size(); s++) {
+        const int chr_id = chr_ids[s];
+        if(chr_id == -1)
+            continue;
+        AnnotationTarget* target = &(*targets)[s];
+        sum_bigwig_annotations<T>(fp, intervals, fp->cl->chrom[tid], target->set->index.chrs[chr_id], chr_id, target, keep_order, &aucs[s]);
+    }
+    release_bigwig_chromosome(intervals, iter);
+    return true;
+}
+
+//annotation IDs of the BigWig's chromosome for each target, false if none have it
+static bool get_bigwig_chr_ids(const bigWigFile_t* fp, const uint32_t tid, const std::vector<AnnotationTarget>* targets, int* chr_ids) {
+    bool annotated = false;
+    for(int s = 0; s < targets->size(); s++) {
+        chr_ids[s] = (*targets)[s].set->index.get_id(fp->cl->chrom[tid]);
+        annotated = annotated || chr_ids[s] != -1;
+    }
+    return annotated;
+}
+
+template <typename T>
+//each chromosome's intervals are fetched once for all of the annotation sets (targets)
+//when keeping the BED order the values are stored in the targets' store_local (by annotation chromosome ID) rather than printed
+static int process_bigwig(const char* fn, std::vector<AnnotationTarget>* targets, bool keep_order = false, FILE* errfp = stderr) {
+    //in part lifted from https://github.com/dpryan79/libBigWig/blob/master/test/testIterator.c
+    bigWigFile_t *fp = bwOpen((char *)fn, NULL, "r");
+    if(!fp) {
+        fprintf(errfp, "Error in opening %s as BigWig file, exiting\n", fn);
         return -1;
     }
-    void (*printPtr) (FILE*, const char*, long, long, T, double*, long) = &print_shared;
-    if(SUMS_ONLY)
-        printPtr = &print_shared_sums_only;
-    uint32_t tid, blocksPerIteration;
-    //ask for huge # of blocks per chromosome to ensure we get all in one go
-    //(this is for convenience, not performance)
-    blocksPerIteration = 4000000;
-    //blocksPerIteration = 1;
-    bwOverlapIterator_t *iter = nullptr;
-    //for certain modes we only want to process BW intervals once
-    std::vector<bool> intervals_seen(STARTING_NUM_INTERVALS,false);
+    const int num_targets = targets->size();
+    std::vector<int> chr_ids(num_targets);
+    std::vector<double> aucs(num_targets);
     //loop through all the chromosomes in the BW
-    for(tid = 0; tid < fp->cl->nKeys; tid++)
+    for(uint32_t tid = 0; tid < fp->cl->nKeys; tid++)
     {
-        //only process the chromosome if it's in the annotation 
-        if(amap->find(fp->cl->chrom[tid]) != amap->end()) {
-            iter = bwOverlappingIntervalsIterator(fp, fp->cl->chrom[tid], 0, fp->cl->len[tid], blocksPerIteration);
-            if(!iter->data)
-            {
-                fprintf(errfp, "WARNING: no interval data for chromosome %s in %s as BigWig file, skipping\n", fp->cl->chrom[tid], fn);
-                continue;
-            }
-            uint32_t num_intervals = iter->intervals->l;
-            if(num_intervals == 0) {
-                fprintf(errfp, "WARNING: 0 intervals for chromosome %s in %s as BigWig file, skipping\n", fp->cl->chrom[tid], fn);
+        //only process the chromosome if it's in one of the annotations
+        if(!get_bigwig_chr_ids(fp, tid, targets, chr_ids.data()))
+            continue;
+        std::fill(aucs.begin(), aucs.end(), 0.0);
+        if(!process_bigwig_chromosome<T>(fp, tid, fn, targets, chr_ids.data(), keep_order, aucs.data(), errfp))
+            continue;
+        for(int s = 0; s < num_targets; s++) {
+            if(chr_ids[s] == -1)
                 continue;
-            }
-            if(op == csum) {
-                if(num_intervals > intervals_seen.size())
-                    intervals_seen.resize(num_intervals, false);
-                for(unsigned int i = 0; i < intervals_seen.size(); i++)
-                    intervals_seen[i] = false;
-            }
-            uint32_t istart = iter->intervals->start[0];
-            uint32_t iend = iter->intervals->end[num_intervals-1];
-            std::vector<T*>& annotations = amap->operator[](fp->cl->chrom[tid]);
-            long z, j, k;
-            long last_j = 0;
-            long asz = annotations.size();
-            double* local_vals;
-            //if running in multithreaded mode, want to store the values locally
-            //but also don't want to reallocate for every new bigwig file, so
-            //we allocate once per thread per chromosome
-            if(store_local) {
-                if(store_local->find(fp->cl->chrom[tid]) == store_local->end())
-                    local_vals = new double[asz];
-                else
-                    local_vals = (*store_local)[fp->cl->chrom[tid]];
-                std::fill(local_vals, local_vals + asz, 0.);
-            }
-            //loop through annotation intervals as outer loop
-            for(z = 0; z < asz; z++) {
-                const auto &az = annotations[z];
-                double sum = 0;
-                double min = MAX_INT;
-                double max = 0;
-                T start = az[0];
-                T ostart = start;
-                T end = az[1];
-                //find the first BW interval starting *before* our annotation interval
-                //this is if we have overlapping/out-of-order intervals in the annotation
-                while(start < iter->intervals->start[last_j])
-                    last_j--;
-                for(j = last_j; j < num_intervals; j++)
-                {
-                    istart = iter->intervals->start[j];
-                    iend = iter->intervals->end[j];
-                    //is our start overlapping?
-                    if(start >= istart && start < iend)
-                    {
-                        long last_k = end > iend ? iend : end;
-                        //stat mode
-                        //avoid having if's in the inner loops as much as possible
-                        switch(op) {
-                            case csum:
-                            case cmean:
-                                for(k = start; k < last_k; k++)
-                                    sum += iter->intervals->value[j];
-                                break;
-                            case cmin:
-                                for(k = start; k < last_k; k++) 
-                                    min = iter->intervals->value[j] < min ? iter->intervals->value[j]:min;
-                                break;
-                            case cmax:
-                                for(k = start; k < last_k; k++) 
-                                    max = iter->intervals->value[j] > max ? iter->intervals->value[j]:max;
-                                break;
-                        }
+            (*targets)[s].chrs_seen[chr_ids[s]] = true;
+            (*targets)[s].annotated_auc += aucs[s];
+        }
+    }
 
-                        //move start up
-                        if(k < end)
-                            start = k;
-                        //break out if we've hit the end of this annotation interval
-                        if(k >= end)
-                            break;
-                    }
-                }
-                last_j = j;
-                if(op == csum)
-                    (*annotated_auc) += sum;
-                //0-based start
-                double annot_length = end - ostart;
-                T value = sum;
-                switch(op) {
-                    case cmean:
-                        value = (double)sum / (double)annot_length;
-                        break;
-                    case cmin:
-                        value = min;
-                        break;
-                    case cmax:
-                        value = max;
-                        break;
-                    case csum:; // do nothing
-                }
-                //not trying to keep the order in the BED file, just print them as we find them
-                if(keep_order_idx == -1)
-                    (*printPtr)(afp, fp->cl->chrom[tid], (long) ostart, (long) end, value, nullptr, 0);
-                else if(store_local)
-                    local_vals[z] = value;
-                else
-                    az[keep_order_idx] = value;
+    bwClose(fp);
+    return 0;
+}
+
+//takes the next chromosome (of tids) until there are none left, w/ its own handle on the BigWig
+template <typename T>
+static void process_bigwig_worker_chromosomes(const char* fn, const std::vector<uint32_t>* tids, std::atomic<int>* next_chr,
+                                              std::vector<AnnotationTarget>* targets, const int* chr_ids, double* aucs, char* processed,
+                                              std::atomic<int>* failed, FILE* errfp) {
+    bigWigFile_t *fp = bwOpen((char *)fn, NULL, "r");
+    if(!fp) {
+        (*failed)++;
+        return;
+    }
+    const int num_targets = targets->size();
+    for(int i = (*next_chr)++; i < tids->size(); i = (*next_chr)++) {
+        const uint32_t tid = (*tids)[i];
+        processed[tid] = process_bigwig_chromosome<T>(fp, tid, fn, targets, &chr_ids[tid*num_targets], true, &aucs[tid*num_targets], errfp);
+    }
+    bwClose(fp);
+}
+
+template <typename T>
+//--threads w/ a single BigWig: the annotated chromosomes are handed out largest first to nthreads workers,
+//each storing into the targets' per chromosome slots; the values are then output in the same order as process_bigwig
+static int process_bigwig_parallel(const char* fn, std::vector<AnnotationTarget>* targets, bool keep_order, int nthreads, FILE* errfp = stderr) {
+    bigWigFile_t *fp = bwOpen((char *)fn, NULL, "r");
+    if(!fp) {
+        fprintf(errfp, "Error in opening %s as BigWig file, exiting\n", fn);
+        return -1;
+    }
+    const int num_targets = targets->size();
+    const uint32_t num_chrs = fp->cl->nKeys;
+    //per BigWig chromosome & target (tid*num_targets + target)
+    std::vector<int> chr_ids(num_chrs*num_targets);
+    std::vector<double> aucs(num_chrs*num_targets, 0.0);
+    std::vector<char> processed(num_chrs, 0);
+    std::vector<uint32_t> tids;
+    for(uint32_t tid = 0; tid < num_chrs; tid++) {
+        if(get_bigwig_chr_ids(fp, tid, targets, &chr_ids[tid*num_targets]))
+            tids.push_back(tid);
+    }
+    //largest first so a long chromosome isn't left to run alone at the end
+    std::stable_sort(tids.begin(), tids.end(), [fp](const uint32_t t1, const uint32_t t2) { return fp->cl->len[t1] > fp->cl->len[t2]; });
+    std::atomic<int> next_chr(0);
+    std::atomic<int> failed(0);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < nthreads; i++)
+        threads.push_back(std::thread(process_bigwig_worker_chromosomes<T>, fn, &tids, &next_chr, targets, chr_ids.data(), aucs.data(),
+                                      processed.data(), &failed, errfp));
+    for(auto& t : threads)
+        t.join();
+    if(failed > 0) {
+        fprintf(errfp, "Error in opening %s as BigWig file, exiting\n", fn);
+        bwClose(fp);
+        return -1;
+    }
+    //now in the BigWig's chromosome order
+    for(uint32_t tid = 0; tid < num_chrs; tid++) {
+        if(!processed[tid])
+            continue;
+        for(int s = 0; s < num_targets; s++) {
+            const int chr_id = chr_ids[tid*num_targets + s];
+            if(chr_id == -1)
+                continue;
+            AnnotationTarget* target = &(*targets)[s];
+            target->chrs_seen[chr_id] = true;
+            target->annotated_auc += aucs[tid*num_targets + s];
+            if(keep_order)
+                continue;
+            const ChrAnnotations& ants = target->set->index.chrs[chr_id];
+            const op_list& ops = target->set->ops;
+            const double* vals = target->store_local[chr_id];
+            //in the chromosome's BED row order
+            for(uint32_t r = 0; r < ants.num_rows; r++) {
+                const uint32_t z = ants.order[r];
+                print_stats<T>(target->afp, fp->cl->chrom[tid], (long) ants.starts[z], (long) ants.ends[z], vals + z*ops.size(), ops);
             }
-            annotation_chrs_seen->insert(fp->cl->chrom[tid]);
-            if(store_local)
-                (*store_local)[fp->cl->chrom[tid]] = local_vals;
-            bwIteratorDestroy(iter);
         }
     }
-
     bwClose(fp);
-    bwCleanup();
     return 0;
 }
 
 
 template <typename T>
-static void output_missing_annotations(const annotation_map_t<T>* annotations, const chr2bool* annotations_seen, FILE* ofp, Op op = csum) {
-    //check if we're doing means output doubles, otherwise output longs
-    T val = 0;
-    void (*printPtr) (FILE*, const char*, long, long, T, double*, long) = &print_shared;
-    if(SUMS_ONLY)
-        printPtr = &print_shared_sums_only;
-    for(auto const& kv : *annotations) {
-        if(annotations_seen->find(kv.first) == annotations_seen->end()) {
-            const auto &ants = kv.second;
-            for(unsigned long z = 0; z < kv.second.size(); z++) {
-                const auto p = ants[z];
-                (*printPtr)(ofp, kv.first.c_str(), p[0], p[1], val, nullptr, z);
+static void output_missing_annotations(const AnnotationIndex* index, const id2bool* annotations_seen, FILE* ofp, const op_list& ops) {
+    std::vector<double> zeros(ops.size(), 0.0);
+    for(int chr_id = 0; chr_id < index->size(); chr_id++) {
+        if(!(*annotations_seen)[chr_id]) {
+            const ChrAnnotations& ants = index->chrs[chr_id];
+            for(unsigned long i = 0; i < ants.num_rows; i++) {
+                const uint32_t z = ants.order[i];
+                print_stats<T>(ofp, ants.name.c_str(), ants.starts[z], ants.ends[z], zeros.data(), ops);
             }
         }
     }
 }
 
+//prints num_afps values per interval (one per output file) from store_local ((z*num_afps + file)*ops.size() + op)
+//chromosomes not seen in the input just get 0's
 template <typename T>
-void output_all_coverage_ordered_by_BED(const strlist* chrm_order, annotation_map_t<T>* annotations, FILE* afp, FILE* uafp, Op op = csum, str2dblist* store_local = nullptr) {
-    double* local_vals = nullptr;
-    for(auto const c : *chrm_order) {
-        if(!c)
-            continue;
-        std::vector<T*>& annotations_for_chr = (*annotations)[c];
-        void (*printPtr) (FILE*, const char*, long, long, T, double*, long) = &print_shared;
-        if(SUMS_ONLY)
-            printPtr = &print_shared_sums_only;
-        if(store_local) {
-            local_vals = (*store_local)[c];
-            printPtr = &print_local;
-            if(SUMS_ONLY)
-                printPtr = &print_local_sums_only;
+void output_all_coverage_ordered_by_BED(const AnnotationIndex* index, FILE** afps, int num_afps, const op_list& ops, const id2dblist* store_local, const id2bool* annotations_seen) {
+    const int num_ops = ops.size();
+    std::vector<double> zeros(num_ops, 0.0);
+    for(int chr_id = 0; chr_id < index->size(); chr_id++) {
+        const ChrAnnotations& ants = index->chrs[chr_id];
+        const char* c = ants.name.c_str();
+        const double* local_vals = (*annotations_seen)[chr_id]?(*store_local)[chr_id]:nullptr;
+        for(long i = 0; i < ants.num_rows; i++) {
+            const long z = ants.order[i];
+            //one value per coverage track (e.g. all, unique)
+            for(int t = 0; t < num_afps; t++)
+                print_stats<T>(afps[t], c, (long) ants.starts[z], (long) ants.ends[z], local_vals?local_vals + (z*num_afps + t)*num_ops:zeros.data(), ops);
         }
-        //check if we're doing means output doubles, otherwise output longs
-        for(long z = 0; z < annotations_for_chr.size(); z++) {
-            const auto &item = annotations_for_chr[z];
-            const T start = item[0], end = item[1];
-            T val = item[2];
-            (*printPtr)(afp, c, (long) start, (long) end, val, local_vals, z);
-            //do uniques if asked to
-            if(uafp) {
-                val = item[3];
-                (*printPtr)(uafp, c, (long) start, (long) end, val, local_vals, z);
+    }
+}
+
+//finishes a BigWig's output for one annotation set, either all of it in BED order
+//or the intervals on chromosomes which weren't in the BigWig
+template <typename T>
+static void output_annotation_target(AnnotationTarget* target, bool keep_order) {
+    const AnnotationSet* set = target->set;
+    if(keep_order)
+        output_all_coverage_ordered_by_BED<T>(&set->index, &target->afp, 1, set->ops, &target->store_local, &target->chrs_seen);
+    else
+        output_missing_annotations<T>(&set->index, &target->chrs_seen, target->afp, set->ops);
+}
+
+//writes a BigWig's values (of the first op) for the annotation in BED order, kept in its store_local, to fn
+//in the --sums-binary format w/ sample_id
+static int write_sums_binary(const AnnotationTarget* target, const char* fn, const std::string& sample_id) {
+    const AnnotationIndex* index = &target->set->index;
+    const int num_ops = target->set->ops.size();
+    FILE* bfp = fopen(fn, "wb");
+    if(!bfp) {
+        fprintf(stderr, "ERROR: could not write %s\n", fn);
+        return -1;
+    }
+    SumsBinaryHeader header;
+    memcpy(header.magic, SUMS_BINARY_MAGIC, 8);
+    header.encoding = SUMS_BINARY;
+    header.id_len = sample_id.size();
+    header.num_values = 0;
+    for(auto const& ants : index->chrs)
+        header.num_values += ants.num_rows;
+    header.annotation_checksum = annotation_checksum(index);
+    std::vector<uint8_t> body(sample_id.begin(), sample_id.end());
+    body.resize((body.size() + 7) / 8 * 8, 0);
+    int64_t prev = 0;
+    for(int chr_id = 0; chr_id < index->size(); chr_id++) {
+        const ChrAnnotations& ants = index->chrs[chr_id];
+        const double* local_vals = target->chrs_seen[chr_id]?target->store_local[chr_id]:nullptr;
+        for(uint32_t i = 0; i < ants.num_rows; i++) {
+            const double value = local_vals?local_vals[ants.order[i]*num_ops]:0.0;
+            if(SUMS_BINARY == SUMS_FLOAT64) {
+                body.insert(body.end(), (const uint8_t*) &value, (const uint8_t*) (&value + 1));
+                continue;
             }
+            const int64_t v = llround(value);
+            const int64_t delta = v - prev;
+            uint64_t zz = ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63);
+            prev = v;
+            do {
+                const uint8_t byte = zz & 0x7f;
+                zz >>= 7;
+                body.push_back(zz?(byte | 0x80):byte);
+            } while(zz);
         }
     }
+    bool ok = fwrite(&header, sizeof(header), 1, bfp) == 1 && fwrite(body.data(), 1, body.size(), bfp) == body.size();
+    ok = (fclose(bfp) == 0) && ok;
+    if(!ok) {
+        fprintf(stderr, "ERROR: could not write %s\n", fn);
+        return -1;
+    }
+    return 0;
 }
 
 //multiple sources for this kind of tokenization, one which was useful was:
@@ -1347,59 +2483,375 @@ void split_string(std::string line, char delim, strvec* tokens) {
     }
 }
 
+//--matrix: list mode's values for the (first) annotation in one matrix, its rows being the distinct annotated intervals
+//& its columns the BigWigs (one per op) in the list's order. it's column major so each BigWig's values are contiguous
+//& the threads never write to the same part of it
+struct AnnotationMatrix {
+    const AnnotationSet* set;
+    //the row of each annotation chromosome's 1st distinct interval
+    std::vector<uint64_t> chr_offsets;
+    uint64_t num_rows;
+    //(column*ops.size() + op)*num_rows + row
+    std::vector<double> vals;
+    //the BigWigs' annotated AUCs & whether they failed, by column
+    std::vector<double> aucs;
+    std::vector<char> failed;
+    AnnotationMatrix(const AnnotationSet* set_, size_t num_columns) : set(set_), num_rows(0), aucs(num_columns, 0.0), failed(num_columns, 0) {
+        for(auto const& ants : set->index.chrs) {
+            chr_offsets.push_back(num_rows);
+            num_rows += ants.size();
+        }
+        vals.assign(num_rows*num_columns*set->ops.size(), 0.0);
+    }
+};
+
+//copies a BigWig's values (kept in BED order in its target's store_local) into its column(s)
+static void fill_matrix_column(AnnotationMatrix* matrix, const uint32_t column, const AnnotationTarget* target, bool failed) {
+    const int num_ops = matrix->set->ops.size();
+    matrix->failed[column] = failed;
+    matrix->aucs[column] = failed?0.0:target->annotated_auc;
+    for(int chr_id = 0; !failed && chr_id < matrix->set->index.size(); chr_id++) {
+        if(!target->chrs_seen[chr_id])
+            continue;
+        const long asz = matrix->set->index.chrs[chr_id].size();
+        const double* local_vals = target->store_local[chr_id];
+        for(int o = 0; o < num_ops; o++) {
+            double* col = &matrix->vals[(column*num_ops + o)*matrix->num_rows + matrix->chr_offsets[chr_id]];
+            for(long z = 0; z < asz; z++)
+                col[z] = local_vals[z*num_ops + o];
+        }
+    }
+}
+
+//writes the matrix as <prefix>.matrix.tsv.gz (bgzipped) one row per BED row in its order
+//w/ a header of the BigWigs' names (w/o their paths, & ".<op>" w/ more than one op),
+//then <prefix>.manifest.tsv w/ each column's BigWig, its annotated AUC & whether it was processed
 template <typename T>
-void process_bigwig_worker(strvec& bwfns, annotation_map_t<T>* annotations, strlist* chrm_order, int keep_order_idx, Op op) {
-    //want to just get the filename itself, no path
-    str2dblist store_local;
-    for(auto bwfn_ : bwfns) {
+static int write_annotation_matrix(const AnnotationMatrix* matrix, const strvec& bwfns, const char* prefix, int nthreads) {
+    static const char* op_names[] = { "sum", "mean", "min", "max", "median", "bases" };
+    const op_list& ops = matrix->set->ops;
+    const int num_ops = ops.size();
+    const size_t num_cols = bwfns.size()*num_ops;
+    char fn[1024];
+    sprintf(fn, "%s.matrix.tsv.gz", prefix);
+    BGZF* mfp = bgzf_open(fn, "w");
+    if(!mfp) {
+        fprintf(stderr, "ERROR: could not write %s\n", fn);
+        return -1;
+    }
+    if(nthreads > 1)
+        bgzf_mt(mfp, nthreads, 256);
+    sprintf(fn, "%s.manifest.tsv", prefix);
+    FILE* manifest_fp = fopen(fn, "w");
+    if(!manifest_fp) {
+        fprintf(stderr, "ERROR: could not write %s\n", fn);
+        bgzf_close(mfp);
+        return -1;
+    }
+    std::string line = SUMS_ONLY?"":"chromosome\tstart\tend";
+    for(uint32_t b = 0; b < bwfns.size(); b++) {
         strvec tokens;
-        const char* bwfn = bwfn_.c_str();
-        fprintf(stderr, "about to process %s\n", bwfn);
-        std::string str(bwfn_);
-        split_string(str, '/', &tokens);
-        char afn[1024];
-        FILE* afp = nullptr;
-        sprintf(afn, "%s.err", tokens.back().c_str());
-        FILE* errfp = fopen(afn, "w");
-        sprintf(afn, "%s.all.tsv", tokens.back().c_str());
-        afp = fopen(afn, "w");
-        chr2bool annotation_chrs_seen;
-        double annotated_auc = 0.0;
-
-        int ret = process_bigwig(bwfn, &annotated_auc, annotations, &annotation_chrs_seen, afp, keep_order_idx, op = op, errfp = errfp, &store_local);
-        if(ret != 0) {
-            fprintf(errfp,"FAILED to process bigwig %s\n", bwfn);
-            if(afp)
-                fclose(afp);
-            fclose(errfp);
-            return;
+        split_string(bwfns[b], '/', &tokens);
+        for(int o = 0; o < num_ops; o++) {
+            if(!line.empty())
+                line += "\t";
+            line += tokens.back();
+            if(num_ops > 1)
+                line += std::string(".") + op_names[ops[o]];
         }
-        //if we wanted to keep the chromosome order of the annotation output matching the input BED file
-        if(keep_order_idx == 2)
-            output_all_coverage_ordered_by_BED(chrm_order, annotations, afp, nullptr, op, &store_local);
+        fprintf(manifest_fp, "%u\t%s\t%s\t%.3f\t%s\n", b, tokens.back().c_str(), bwfns[b].c_str(), matrix->aucs[b], matrix->failed[b]?"FAILED":"SUCCESS");
+    }
+    fclose(manifest_fp);
+    line += "\n";
+    bool ok = bgzf_write(mfp, line.c_str(), line.size()) >= 0;
+    //op by op of a row, like print_stats
+    std::vector<double> vals(num_cols);
+    char buf[64];
+    for(int chr_id = 0; ok && chr_id < matrix->set->index.size(); chr_id++) {
+        const ChrAnnotations& ants = matrix->set->index.chrs[chr_id];
+        for(long i = 0; ok && i < ants.num_rows; i++) {
+            const uint64_t row = matrix->chr_offsets[chr_id] + ants.order[i];
+            for(size_t c = 0; c < num_cols; c++)
+                vals[c] = matrix->vals[c*matrix->num_rows + row];
+            line.clear();
+            if(!SUMS_ONLY) {
+                sprintf(buf, "%s\t%u\t%u", ants.name.c_str(), ants.starts[ants.order[i]], ants.ends[ants.order[i]]);
+                line += buf;
+            }
+            for(size_t c = 0; c < num_cols; c++) {
+                const char* sep = (c > 0 || !SUMS_ONLY)?"\t":"";
+                if(std::is_same<T, long>::value && ops[c % num_ops] != cmean && ops[c % num_ops] != cmedian)
+                    sprintf(buf, "%s%lu", sep, (long) vals[c]);
+                else
+                    sprintf(buf, "%s%.3f", sep, vals[c]);
+                line += buf;
+            }
+            line += "\n";
+            ok = bgzf_write(mfp, line.c_str(), line.size()) >= 0;
+        }
+    }
+    ok = bgzf_close(mfp) == 0 && ok;
+    if(!ok) {
+        fprintf(stderr, "ERROR: could not write %s.matrix.tsv.gz\n", prefix);
+        return -1;
+    }
+    return 0;
+}
+
+//opens a list mode BigWig's outputs, named after the file w/o its path, in the current directory
+//& resets its targets for it, returning its error log (just stderr w/ --matrix)
+static FILE* open_bigwig_list_outputs(const char* bwfn, std::vector<AnnotationTarget>* targets, const AnnotationMatrix* matrix) {
+    if(matrix) {
+        for(auto& target : *targets) {
+            target.annotated_auc = 0.0;
+            std::fill(target.chrs_seen.begin(), target.chrs_seen.end(), false);
+        }
+        return stderr;
+    }
+    strvec tokens;
+    split_string(std::string(bwfn), '/', &tokens);
+    char afn[1024];
+    sprintf(afn, "%s.err", tokens.back().c_str());
+    FILE* errfp = fopen(afn, "w");
+    for(auto& target : *targets) {
+        if(target.set->label.empty())
+            sprintf(afn, "%s.all.tsv", tokens.back().c_str());
         else
-            output_missing_annotations(annotations, &annotation_chrs_seen, afp, op = op);
-        if(afp)
-            fclose(afp);
-        //fprintf(aucfp, "AUC\t%" PRIu64 "\n", annotated_auc);
-        fprintf(stdout, "AUC_ANNOTATED_BASES\t%.3f\t%s\n", annotated_auc, bwfn);
-        //fprintf(errfp, "AUC\t%.3f\n", annotated_auc);
-        fprintf(errfp,"SUCCESS processing bigwig %s\n", bwfn);
+            sprintf(afn, "%s.%s.tsv", tokens.back().c_str(), target.set->label.c_str());
+        //the first annotation's written to <BigWig>.sums.bin at the end w/ --sums-binary
+        target.afp = (SUMS_BINARY >= 0 && &target == &(*targets)[0])?nullptr:fopen(afn, "w");
+        target.annotated_auc = 0.0;
+        std::fill(target.chrs_seen.begin(), target.chrs_seen.end(), false);
+    }
+    return errfp;
+}
+
+//finishes (unless it failed) & closes a list mode BigWig's outputs, or fills its matrix column
+template <typename T>
+static void close_bigwig_list_outputs(const char* bwfn, std::vector<AnnotationTarget>* targets, bool keep_order, bool failed, FILE* errfp,
+                                      AnnotationMatrix* matrix, uint32_t column) {
+    if(matrix) {
+        fill_matrix_column(matrix, column, &(*targets)[0], failed);
+        if(failed)
+            fprintf(errfp, "FAILED to process bigwig %s\n", bwfn);
+        return;
+    }
+    if(failed) {
+        fprintf(errfp,"FAILED to process bigwig %s\n", bwfn);
+        for(auto& target : *targets) {
+            if(target.afp)
+                fclose(target.afp);
+        }
         fclose(errfp);
+        return;
+    }
+    //if we wanted to keep the chromosome order of the annotation output matching the input BED file
+    for(auto& target : *targets) {
+        if(!target.afp) {
+            strvec tokens;
+            split_string(std::string(bwfn), '/', &tokens);
+            char bfn[1024];
+            sprintf(bfn, "%s.sums.bin", tokens.back().c_str());
+            write_sums_binary(&target, bfn, tokens.back());
+            continue;
+        }
+        output_annotation_target<T>(&target, keep_order);
+        fclose(target.afp);
+    }
+    fprintf(stdout, "AUC_ANNOTATED_BASES\t%.3f\t%s\n", targets->empty()?0.0:(*targets)[0].annotated_auc, bwfn);
+    fflush(stdout);
+    fprintf(errfp,"SUCCESS processing bigwig %s\n", bwfn);
+    fclose(errfp);
+}
+
+//pulls the next BigWig off the shared (largest first) list until there are none left
+template <typename T>
+void process_bigwig_worker(const strvec& bwfns, std::atomic<size_t>* next_file, const annotation_sets& annotations, bool keep_order,
+                           AnnotationMatrix* matrix, const std::vector<uint32_t>* columns) {
+    //store_local is kept across the files, only allocated once per thread
+    std::vector<AnnotationTarget> targets;
+    for(auto set : annotations)
+        targets.push_back(AnnotationTarget(set, nullptr));
+    size_t i;
+    while((i = next_file->fetch_add(1)) < bwfns.size()) {
+        const char* bwfn = bwfns[i].c_str();
+        fprintf(stderr, "about to process %s\n", bwfn);
+        FILE* errfp = open_bigwig_list_outputs(bwfn, &targets, matrix);
+        int ret = process_bigwig<T>(bwfn, &targets, keep_order, errfp);
+        close_bigwig_list_outputs<T>(bwfn, &targets, keep_order, ret != 0, errfp, matrix, (*columns)[i]);
     }
     //hold off on final deletion, for performance
     /*for( auto mitr : store_local)
         delete mitr.second;*/
 }
 
-Op get_operation(const char* opstr) {
-    if(strcmp(opstr, "mean") == 0)
-        return cmean;
-    if(strcmp(opstr, "min") == 0)
-        return cmin;
-    if(strcmp(opstr, "max") == 0)
-        return cmax;
-    return csum;
+//one BigWig of a --batch, w/ its own targets (outputs) for the annotation sets
+struct BatchedBigWig {
+    const char* fn;
+    //its --matrix column
+    uint32_t column;
+    bigWigFile_t* fp;
+    FILE* errfp;
+    std::vector<AnnotationTarget> targets;
+    //the BigWig's chromosome IDs
+    str2int tids;
+    //the current chromosome's intervals
+    bwOverlappingIntervals_t* intervals;
+    bwOverlapIterator_t* iter;
+};
+
+//one chromosome across a --batch of BigWigs: each one's intervals are fetched, then every annotation set
+//is swept once for all of them together, filling an (annotated interval x BigWig) block of values
+//which is then printed, or stored for the BED order, per BigWig
+template <typename T>
+static void process_bigwig_batch_chromosome(std::vector<BatchedBigWig>* batch, const std::string& chrm, const annotation_sets& annotations, bool keep_order) {
+    const int num_sets = annotations.size();
+    const int nbw = batch->size();
+    std::vector<int> chr_ids(num_sets);
+    bool annotated = false;
+    for(int s = 0; s < num_sets; s++) {
+        chr_ids[s] = annotations[s]->index.get_id(chrm.c_str());
+        annotated = annotated || chr_ids[s] != -1;
+    }
+    if(!annotated)
+        return;
+    //the fetch plan only depends on the annotation (& the chromosome's length)
+    interval_list clusters;
+    bool sparse = false;
+    bool planned = false;
+    for(auto& bw : *batch) {
+        bw.intervals = nullptr;
+        bw.iter = nullptr;
+        auto it = bw.tids.find(chrm);
+        if(!bw.fp || it == bw.tids.end())
+            continue;
+        const uint32_t tid = it->second;
+        if(!planned)
+            sparse = cluster_annotations(&bw.targets, chr_ids.data(), bw.fp->cl->len[tid], &clusters);
+        planned = true;
+        bw.intervals = fetch_bigwig_chromosome(bw.fp, tid, bw.fn, clusters, sparse, &bw.iter, bw.errfp);
+    }
+    std::vector<double> block;
+    std::vector<long> first_js(nbw);
+    std::vector<std::pair<double, uint32_t>> runs;
+    for(int s = 0; s < num_sets; s++) {
+        const int chr_id = chr_ids[s];
+        if(chr_id == -1)
+            continue;
+        const ChrAnnotations& ants = annotations[s]->index.chrs[chr_id];
+        const op_list& ops = annotations[s]->ops;
+        const int num_ops = ops.size();
+        const bool sum_auc = std::find(ops.begin(), ops.end(), csum) != ops.end();
+        const long asz = ants.size();
+        //(z*nbw + BigWig)*num_ops + op
+        block.assign(asz*nbw*num_ops, 0.0);
+        std::fill(first_js.begin(), first_js.end(), 0);
+        for(long z = 0; z < asz; z++) {
+            const uint32_t nrows = ants.row_count(z);
+            for(int b = 0; b < nbw; b++) {
+                BatchedBigWig& bw = (*batch)[b];
+                if(!bw.intervals)
+                    continue;
+                const double sum = bigwig_interval_stats(bw.fp, bw.intervals, &first_js[b], chrm.c_str(), ants.starts[z], ants.ends[z], ops,
+                                                         &runs, &block[(z*nbw + b)*num_ops]);
+                if(sum_auc)
+                    bw.targets[s].annotated_auc += sum*nrows;
+            }
+        }
+        for(int b = 0; b < nbw; b++) {
+            BatchedBigWig& bw = (*batch)[b];
+            if(!bw.intervals)
+                continue;
+            AnnotationTarget* target = &bw.targets[s];
+            target->chrs_seen[chr_id] = true;
+            if(keep_order && !target->store_local[chr_id])
+                target->store_local[chr_id] = new double[asz*num_ops];
+            if(keep_order) {
+                for(long z = 0; z < asz; z++)
+                    std::copy(&block[(z*nbw + b)*num_ops], &block[(z*nbw + b + 1)*num_ops], target->store_local[chr_id] + z*num_ops);
+            }
+            //in the chromosome's BED row order
+            else {
+                for(uint32_t r = 0; r < ants.num_rows; r++) {
+                    const long z = ants.order[r];
+                    print_stats<T>(target->afp, chrm.c_str(), (long) ants.starts[z], (long) ants.ends[z], &block[(z*nbw + b)*num_ops], ops);
+                }
+            }
+        }
+    }
+    for(auto& bw : *batch)
+        release_bigwig_chromosome(bw.intervals, bw.iter);
+}
+
+//--batch: pulls the next batch_size BigWigs off the shared (largest first) list until there are none left,
+//opening them together & going through them chromosome by chromosome (see process_bigwig_batch_chromosome)
+//so each chromosome's annotation is read once per batch rather than once per BigWig
+template <typename T>
+void process_bigwig_batch_worker(const strvec& bwfns, std::atomic<size_t>* next_file, size_t batch_size, const annotation_sets& annotations, bool keep_order,
+                                 AnnotationMatrix* matrix, const std::vector<uint32_t>* columns) {
+    std::vector<BatchedBigWig> batch(batch_size);
+    for(auto& bw : batch) {
+        for(auto set : annotations)
+            bw.targets.push_back(AnnotationTarget(set, nullptr));
+    }
+    size_t first;
+    while((first = next_file->fetch_add(batch_size)) < bwfns.size()) {
+        batch.resize(std::min(batch_size, bwfns.size() - first));
+        //chromosomes in the order they're first seen in the batch's BigWigs
+        strvec chrms;
+        str2int chrms_seen;
+        for(int b = 0; b < batch.size(); b++) {
+            BatchedBigWig& bw = batch[b];
+            bw.fn = bwfns[first + b].c_str();
+            bw.column = (*columns)[first + b];
+            fprintf(stderr, "about to process %s\n", bw.fn);
+            bw.errfp = open_bigwig_list_outputs(bw.fn, &bw.targets, matrix);
+            bw.tids.clear();
+            bw.fp = bwOpen((char *)bw.fn, NULL, "r");
+            if(!bw.fp) {
+                fprintf(bw.errfp, "Error in opening %s as BigWig file, exiting\n", bw.fn);
+                continue;
+            }
+            for(uint32_t tid = 0; tid < bw.fp->cl->nKeys; tid++) {
+                bw.tids[bw.fp->cl->chrom[tid]] = tid;
+                if(chrms_seen.emplace(bw.fp->cl->chrom[tid], 1).second)
+                    chrms.push_back(bw.fp->cl->chrom[tid]);
+            }
+        }
+        for(auto const& chrm : chrms)
+            process_bigwig_batch_chromosome<T>(&batch, chrm, annotations, keep_order);
+        for(auto& bw : batch) {
+            close_bigwig_list_outputs<T>(bw.fn, &bw.targets, keep_order, !bw.fp, bw.errfp, matrix, bw.column);
+            if(bw.fp)
+                bwClose(bw.fp);
+        }
+    }
+}
+
+//-1 if opstr isn't one of the ops
+static int get_operation(const char* opstr, Op* op) {
+    static const char* names[] = { "sum", "mean", "min", "max", "median", "bases" };
+    static const Op ops[] = { csum, cmean, cmin, cmax, cmedian, cbases };
+    for(int i = 0; i < sizeof(ops)/sizeof(Op); i++) {
+        if(strcmp(opstr, names[i]) == 0) {
+            *op = ops[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+//adds the ops named in fields[first:] to ops
+static int parse_ops(const strvec& fields, int first, op_list* ops) {
+    for(int i = first; i < fields.size(); i++) {
+        Op op;
+        if(get_operation(fields[i].c_str(), &op) != 0) {
+            std::cerr << "ERROR: unknown op \"" << fields[i] << "\", pass sum, mean, min, max, median or bases" << std::endl;
+            return -1;
+        }
+        ops->push_back(op);
+    }
+    return 0;
 }
 
 
@@ -1407,116 +2859,379 @@ typedef hashmap<std::string, uint8_t*> str2str;
 static const uint64_t frag_lens_mask = 0x00000000FFFFFFFF;
 static const int FRAG_LEN_BITLEN = 32;
 template <typename T>
-int go_bw(const char* bw_arg, int argc, const char** argv, Op op, htsFile *bam_fh, int nthreads, bool keep_order, bool has_annotation, FILE* afp, annotation_map_t<T>* annotations, chr2bool* annotation_chrs_seen, const char* prefix, bool sum_annotation, strlist* chrm_order, FILE* auc_file) {
+int go_bw(const char* bw_arg, int argc, const char** argv, htsFile *bam_fh, int nthreads, bool keep_order, bool has_annotation, const annotation_sets& annotations, const char* prefix, bool sum_annotation, FILE* auc_file) {
     //only calculate AUC across either the BAM or the BigWig, but could be restricting to an annotation as well
     int err = 0;
-    bool LOAD_BALANCE = false;
     int slen = strlen(bw_arg);
     bool is_bw_list_file = strcmp(bw_arg+(slen-3), "txt") == 0;
     fprintf(stderr,"Processing %s\n",bw_arg);
     fflush(stderr);
-    //just do all/total AUC if no options are passed in
-    if(argc == 1 
-            || (argc == 2 && has_option(argv, argv+argc, "--auc"))
-            || (argc == 3 && has_option(argv, argv+argc, "--bwbuffer"))
-            || (argc == 4 && has_option(argv, argv+argc, "--bwbuffer") && has_option(argv, argv+argc, "--auc"))) {
+    //just do all/total AUC if no options are passed in (other than --exact)
+    const bool exact = has_option(argv, argv+argc, "--exact");
+    const int nargs = exact?argc-1:argc;
+    if(init_bigwig_reader(nthreads, has_option(argv, argv+argc, "--bwbuffer")) != 0)
+        return -1;
+    if(nargs == 1 
+            || (nargs == 2 && has_option(argv, argv+argc, "--auc"))
+            || (nargs == 3 && has_option(argv, argv+argc, "--bwbuffer"))
+            || (nargs == 4 && has_option(argv, argv+argc, "--bwbuffer") && has_option(argv, argv+argc, "--auc"))) {
         //should be the same as "all_auc" except support possibility of continuous values
         //in the BigWig (but not in the BAM, since we control how we count)
         double total_auc = 0.0;
-        int ret = process_bigwig_for_total_auc(bw_arg, &total_auc);
+        int ret = process_bigwig_for_total_auc(bw_arg, &total_auc, exact);
         if(ret == 0)
             fprintf(stdout, "AUC_ALL_BASES\t%.3f\n", total_auc);
+        bwCleanup();
         return ret;
     }
 
     double annotated_total_auc = 0.0;
     //process bigwig for annotation/auc
-    int keep_order_idx = keep_order?2:-1;
-    //TODO: look into implemention multithreaded mode for single BigWig processing (maybe per chromosome?)
     if(is_bw_list_file) {
-        strvec* files_per_thread[nthreads];
-        uint64_t bytes_per_thread[nthreads];
-        for(int i=0; i < nthreads; i++) {
-            files_per_thread[i] = new strvec();
-            bytes_per_thread[i] = 0;
-        }
         FILE* bw_list_fp = fopen(bw_arg, "r");
         if(unlikely(bw_list_fp == nullptr)) assert(false);
         char *bwfn = (char *)std::malloc(LINE_BUFFER_LENGTH);
         size_t length = LINE_BUFFER_LENGTH;
         ssize_t bytes_read = getline(&bwfn, &length, bw_list_fp);
-        int file_idx = 0;
         struct stat fstat;
-        mate2len file2size;
-        strvec files;
-        std::vector<uint64_t> fsizes;
-        uint64_t total_fsize = 0;
-        uint32_t num_files = 0;
+        //(size, position in the list), remote BigWigs don't have a size w/o a request per file
+        //so they're put first as they're typically the slowest
+        std::vector<std::pair<uint64_t, uint32_t>> sized_files;
+        strvec list_files;
         while(bytes_read != -1) {
             char *bp = bwfn;
-            bp[bytes_read-1]='\0';
-            int thread_i = file_idx++ % nthreads;
-            std::string str(bp);
-            files.push_back(str);
-            if(LOAD_BALANCE) {
-                stat(bp, &fstat);
-                fsizes.push_back(fstat.st_size);
-                total_fsize += fstat.st_size;
-            }
-            num_files++;
+            if(bp[bytes_read-1] == '\n')
+                bp[bytes_read-1]='\0';
+            uint64_t fsize = UINT64_MAX;
+            if(stat(bp, &fstat) == 0)
+                fsize = fstat.st_size;
+            if(bp[0] != '\0') {
+                sized_files.push_back(std::make_pair(fsize, (uint32_t) list_files.size()));
+                list_files.push_back(std::string(bp));
+            }
             bytes_read = getline(&bwfn, &length, bw_list_fp);
         }
-        //now load balance between threads based on file size
-        uint64_t per_thread_size = total_fsize / nthreads;
-        int max_num_files_per_thread = num_files / nthreads;
-        int thread_i = 0;
-        int num_files_current_thread = 0;
-        for(int i=0; i < num_files; i++) {
-            if((LOAD_BALANCE && bytes_per_thread[thread_i] + fsizes[i] > per_thread_size) ||
-                (num_files_current_thread >= max_num_files_per_thread) && thread_i+1 < nthreads) {
-                thread_i++;
-                num_files_current_thread = 0;
-            }
-            if(LOAD_BALANCE)
-                bytes_per_thread[thread_i] += fsizes[i];
-            files_per_thread[thread_i]->push_back(files[i]);
-            num_files_current_thread++;
+        fclose(bw_list_fp);
+        std::free(bwfn);
+        //largest first so a big file doesn't start last & leave one thread straggling
+        std::stable_sort(sized_files.begin(), sized_files.end(),
+                [](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) { return a.first > b.first; });
+        strvec files;
+        std::vector<uint32_t> columns;
+        for(auto& sized_file : sized_files) {
+            files.push_back(list_files[sized_file.second]);
+            columns.push_back(sized_file.second);
+        }
+        //--matrix: all of the BigWigs' values for the first annotation go into one matrix (so they're kept in BED order)
+        AnnotationMatrix* matrix = nullptr;
+        annotation_sets list_sets = annotations;
+        if(has_option(argv, argv+argc, "--matrix")) {
+            if(annotations.empty()) {
+                std::cerr << "ERROR: --matrix requires --annotation" << std::endl;
+                bwCleanup();
+                return -1;
+            }
+            matrix = new AnnotationMatrix(annotations[0], list_files.size());
+            list_sets.resize(1);
+            keep_order = true;
+        }
+        std::atomic<size_t> next_file(0);
+        std::vector<std::thread> threads;
+        //--batch: each thread goes through this many BigWigs together, chromosome by chromosome
+        size_t batch_size = 1;
+        if(has_option(argv, argv+argc, "--batch"))
+            batch_size = std::max(1L, atol(*(get_option(argv, argv+argc, "--batch"))));
+        //at least one thread w/o --threads
+        for(int i=0; i < std::max(nthreads, 1) && i*batch_size < files.size(); i++) {
+            if(batch_size > 1)
+                threads.push_back(std::thread(process_bigwig_batch_worker<T>, std::cref(files), &next_file, batch_size, std::cref(list_sets), keep_order,
+                                              matrix, &columns));
+            else
+                threads.push_back(std::thread(process_bigwig_worker<T>, std::cref(files), &next_file, std::cref(list_sets), keep_order,
+                                              matrix, &columns));
+        }
+        for(auto &t: threads) t.join();
+        if(matrix) {
+            err = write_annotation_matrix<T>(matrix, list_files, prefix, nthreads);
+            delete matrix;
+        }
+        for(auto set : annotations) {
+            if(set->afp && set->afp != stdout)
+                fclose(set->afp);
+        }
+        bwCleanup();
+        return err; 
+    }
+    //don't have a list of BigWigs, so just process the single one
+    std::vector<AnnotationTarget> targets;
+    for(auto set : annotations)
+        targets.push_back(AnnotationTarget(set, set->afp));
+    //w/ --threads, one chromosome per thread at a time
+    int ret = 0;
+    if(nthreads > 1)
+        ret = process_bigwig_parallel<T>(bw_arg, &targets, keep_order, nthreads, stderr);
+    else
+        ret = process_bigwig<T>(bw_arg, &targets, keep_order, stderr);
+    //if we wanted to keep the chromosome order of the annotation output matching the input BED file
+    for(auto& target : targets) {
+        //the first annotation w/ --sums-binary
+        if(!target.afp && ret == 0) {
+            strvec tokens;
+            split_string(std::string(bw_arg), '/', &tokens);
+            char bfn[1024];
+            sprintf(bfn, "%s.sums.bin", prefix);
+            ret = write_sums_binary(&target, bfn, tokens.back());
+        }
+        else if(target.afp)
+            output_annotation_target<T>(&target, keep_order);
+        for(auto vals : target.store_local)
+            delete[] vals;
+        if(target.afp && target.afp != stdout)
+            fclose(target.afp);
+    }
+    //the annotated AUC is for the first annotation set
+    if(!targets.empty())
+        annotated_total_auc = targets[0].annotated_auc;
+    if(ret == 0 && auc_file)
+        fprintf(auc_file, "AUC_ANNOTATED_BASES\t%.3f\n", annotated_total_auc);
+    if(auc_file && auc_file != stdout)
+        fclose(auc_file);
+    bwCleanup();
+    return ret;
+}
+
+//coverage tracks and their outputs for one group of alignments:
+//the whole BAM, or a single read group with --split-by RG
+struct CoverageGroup {
+    //empty for the whole BAM, otherwise the read group ID
+    std::string id;
+    coverage_tracks tracks;
+    //interleaved per-base coverage for the current chromosome,
+    //only allocated once the group has an alignment on it
+    uint32_t* coverages;
+    //# of positions allocated in coverages, the chromosome's length unless an alignment hangs off its end
+    long coverages_len;
+    FILE* cov_fh;
+    //per annotation set: values per annotated chromosome (num_tracks * # ops per interval) when keeping the BED order
+    std::vector<id2dblist> annotation_sums;
+    std::vector<id2bool> annotation_chrs_seen;
+    //per annotation set, one output per track (set*num_tracks + track)
+    std::vector<FILE*> afps;
+    //--aggregate-by-name sums over each name group's union (num_tracks per name group)
+    std::vector<double> name_group_sums;
+    //outputs are written to <file_prefix>.*
+    std::string file_prefix;
+};
+//read group used for alignments without an RG:Z tag when splitting
+static const char NO_READ_GROUP[] = "NO_RG";
+
+//sets up a group's tracks and opens its BigWig/annotation outputs;
+//a group w/ an ID writes all of its outputs to files named <prefix>.<ID>.*
+static CoverageGroup* create_coverage_group(const std::string& id, const coverage_tracks& track_defs, const bam_hdr_t* hdr,
+                                            const char* prefix, const bool bigwig_opt, const bool annotation_opt,
+                                            const bool no_annotation_stdout, const bool shared_afps, FILE* cov_fh, const annotation_sets& annotations) {
+    CoverageGroup* group = new CoverageGroup();
+    group->id = id;
+    group->tracks = track_defs;
+    group->coverages = nullptr;
+    group->coverages_len = 0;
+    group->cov_fh = cov_fh;
+    for(auto set : annotations) {
+        group->annotation_sums.push_back(id2dblist(set->index.size(), nullptr));
+        group->annotation_chrs_seen.push_back(id2bool(set->index.size(), false));
+    }
+    if(!annotations.empty())
+        group->name_group_sums.resize(annotations[0]->index.group_names.size()*track_defs.size(), 0.0);
+    std::string group_prefix(prefix);
+    if(!id.empty()) {
+        std::string fn_id(id);
+        std::replace(fn_id.begin(), fn_id.end(), '/', '_');
+        group_prefix += "." + fn_id;
+    }
+    group->file_prefix = group_prefix;
+    for(int t = 0; t < group->tracks.size(); t++) {
+        CoverageTrack& track = group->tracks[t];
+        if(bigwig_opt) {
+            char bw_suffix[1024];
+            sprintf(bw_suffix, "%s.bw", track.name.c_str());
+            track.bwfp = create_bigwig_file(hdr, group_prefix.c_str(), bw_suffix);
+        }
+    }
+    if(!annotation_opt)
+        return group;
+    //the first track of the whole BAM goes to the annotation set's output, the rest to <prefix>[.<label>].<track>.tsv
+    for(auto set : annotations) {
+        for(int t = 0; t < group->tracks.size(); t++) {
+            const CoverageTrack& track = group->tracks[t];
+            FILE* afp = nullptr;
+            if(t == ALL_TRACK && shared_afps && set->afp)
+                afp = set->afp;
+            else if(!no_annotation_stdout && id.empty() && set->label.empty())
+                afp = stdout;
+            else {
+                char afn[1024];
+                if(set->label.empty())
+                    sprintf(afn, "%s.%s.tsv", group_prefix.c_str(), t == ALL_TRACK?"annotation":track.name.c_str());
+                else if(t == ALL_TRACK)
+                    sprintf(afn, "%s.%s.tsv", group_prefix.c_str(), set->label.c_str());
+                else
+                    sprintf(afn, "%s.%s.%s.tsv", group_prefix.c_str(), set->label.c_str(), track.name.c_str());
+                afp = fopen(afn, "w");
+            }
+            group->afps.push_back(afp);
+        }
+    }
+    return group;
+}
+
+//--umi-dedup: of the alignments sharing a start, strand, mate start & UMI (a duplicate group)
+//only the first seen counts toward coverage, the 2nd mate of a pair follows the 1st's decision.
+//since the BAM is sorted, groups are only kept for the current start position
+//and pending mates only until the stream moves past their start
+struct UmiDedup {
+    const char* tag;
+    //UMIs 1 mismatch apart are treated as the same molecule
+    bool allow_mismatch;
+    int32_t tid;
+    int32_t pos;
+    //(strand, mate chromosome, mate start) at the current start -> UMIs (and their coverage group) already counted
+    hashmap<uint64_t, std::vector<std::pair<int, std::string>>> window;
+    //1st mate's decision (true: duplicate) for mates still to come
+    hashmap<std::string, bool> pending_mates;
+    //(mate start, read name) so mates which never show up are dropped once passed
+    std::priority_queue<std::pair<int32_t, std::string>, std::vector<std::pair<int32_t, std::string>>,
+                        std::greater<std::pair<int32_t, std::string>>> pending_order;
+    uint64_t duplicates;
+};
+
+static inline bool same_umi(const std::string& umi1, const char* umi2, const bool allow_mismatch) {
+    if(!allow_mismatch)
+        return strcmp(umi1.c_str(), umi2) == 0;
+    int mismatches = 0;
+    int i = 0;
+    for(; i < umi1.size() && umi2[i] != '\0'; i++) {
+        if(umi1[i] != umi2[i] && ++mismatches > 1)
+            return false;
+    }
+    return i == umi1.size() && umi2[i] == '\0';
+}
+
+//true if the alignment duplicates one already counted in the same coverage group
+static bool is_umi_duplicate(const bam1_t* rec, const int group, UmiDedup* dd) {
+    const bam1_core_t* c = &rec->core;
+    if(c->tid != dd->tid) {
+        dd->window.clear();
+        dd->pending_mates.clear();
+        dd->pending_order = decltype(dd->pending_order)();
+        dd->tid = c->tid;
+        dd->pos = -1;
+    }
+    if(c->pos != dd->pos) {
+        dd->window.clear();
+        dd->pos = c->pos;
+        while(!dd->pending_order.empty() && dd->pending_order.top().first < c->pos) {
+            dd->pending_mates.erase(dd->pending_order.top().second);
+            dd->pending_order.pop();
+        }
+    }
+    //supplementary alignments share the read name but aren't the mate
+    if((c->flag & BAM_FSUPPLEMENTARY) != 0)
+        return false;
+    const bool paired = (c->flag & BAM_FPAIRED) != 0 && (c->flag & BAM_FMUNMAP) == 0;
+    const char* qname = bam_get_qname(rec);
+    if(paired && !dd->pending_mates.empty()) {
+        auto it = dd->pending_mates.find(qname);
+        if(it != dd->pending_mates.end()) {
+            const bool dup = it->second;
+            dd->pending_mates.erase(it);
+            dd->duplicates += dup;
+            return dup;
+        }
+    }
+    const uint8_t* up = bam_aux_get(rec, dd->tag);
+    const char* umi = up?bam_aux2Z(up):nullptr;
+    if(!umi)
+        return false;
+    uint64_t key = (((uint64_t) ((c->flag & BAM_FREVERSE) != 0)) << 63);
+    if(paired)
+        key |= (((uint64_t) (c->mtid+1)) << 32) | (uint32_t) (c->mpos+1);
+    std::vector<std::pair<int, std::string>>& counted = dd->window[key];
+    bool dup = false;
+    for(auto const& rep : counted) {
+        if(rep.first == group && same_umi(rep.second, umi, dd->allow_mismatch)) {
+            dup = true;
+            break;
         }
-        std::vector<std::thread> threads;
-        for(int i=0; i < nthreads; i++) {
-                threads.push_back(std::thread(process_bigwig_worker<T>, std::ref(*(files_per_thread[i])), annotations, chrm_order, keep_order_idx, op=op));
+    }
+    if(!dup)
+        counted.emplace_back(group, umi);
+    if(paired && c->mtid == c->tid && c->mpos >= c->pos) {
+        dd->pending_mates[qname] = dup;
+        dd->pending_order.emplace(c->mpos, qname);
+    }
+    dd->duplicates += dup;
+    return dup;
+}
+
+//--aggregate-by-name: adds every track's coverage over the chromosome's merged name group segments
+static void sum_name_groups(const uint32_t* coverages, const int num_tracks, const std::vector<GroupSegment>& segments, double* sums) {
+    for(auto const& seg : segments) {
+        double* gsums = sums + seg.group*num_tracks;
+        for(uint32_t j = seg.start; j < seg.end; j++) {
+            const uint32_t* pos_covs = coverages + j*num_tracks;
+            for(int t = 0; t < num_tracks; t++)
+                gsums[t] += pos_covs[t];
         }
-        for(auto &t: threads) t.join();
-        fclose(bw_list_fp);
-        if(afp)
-            fclose(afp);
-        std::free(bwfn);
-        return 0; 
     }
-    //don't have a list of BigWigs, so just process the single one
-    int ret = process_bigwig(bw_arg, &annotated_total_auc, annotations, annotation_chrs_seen, afp, keep_order_idx, op=op);
-    //if we wanted to keep the chromosome order of the annotation output matching the input BED file
-    if(keep_order)
-        output_all_coverage_ordered_by_BED(chrm_order, annotations, afp, nullptr, op);
-    else
-        output_missing_annotations(annotations, annotation_chrs_seen, afp, op = op);
-    if(afp && afp != stdout)
-        fclose(afp);
-    if(ret == 0 && auc_file)
-        fprintf(auc_file, "AUC_ANNOTATED_BASES\t%.3f\n", annotated_total_auc);
-    if(auc_file && auc_file != stdout)
-        fclose(auc_file);
-    return ret;
 }
 
+//one line per name group in BED order: name, union length, sum, mean (sum / union length)
+static void output_name_groups(const AnnotationIndex* annotations, const double* sums, const int num_tracks, const int t, FILE* gfp) {
+    for(uint32_t g = 0; g < annotations->group_names.size(); g++) {
+        const uint64_t len = annotations->group_lengths[g];
+        const double sum = sums[g*num_tracks + t];
+        fprintf(gfp, "%s\t%" PRIu64 "\t%.0f\t%.3f\n", annotations->group_names[g].c_str(), len, sum, len > 0?sum/len:0.0);
+    }
+}
+
+//outputs the coverage of a group for a finished chromosome and frees it,
+//chr_ids are the chromosome's annotation IDs, one per annotation set (-1 if not annotated)
 template <typename T>
-int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam_fh, int nthreads, bool keep_order, bool has_annotation, FILE* afp, annotation_map_t<T>* annotations, chr2bool* annotation_chrs_seen, const char* prefix, bool sum_annotation, strlist* chrm_order, FILE* auc_file) {
-    //only calculate AUC across either the BAM or the BigWig, but could be restricting to an annotation as well
-    uint64_t all_auc = 0;
-    uint64_t unique_auc = 0;
-    uint64_t annotated_auc = 0;
-    uint64_t unique_annotated_auc = 0;
+static void finish_group_chromosome(CoverageGroup* group, const int num_tracks, const bam_hdr_t* hdr, const int32_t tid,
+                                    const annotation_sets& annotations, const int* chr_ids, const bool print_coverage, const bool dont_output_coverage,
+                                    const bool sum_annotation, const bool keep_order) {
+    if(!group->coverages)
+        return;
+    char* chrm = hdr->target_name[tid];
+    if(print_coverage)
+        print_array(chrm, group->coverages, num_tracks, hdr->target_len[tid], false, &group->tracks, group->cov_fh, dont_output_coverage);
+    //if we also want to sum coverage across user supplied files of annotated regions,
+    //all from the chromosome's coverage before it's freed
+    for(int s = 0; sum_annotation && s < annotations.size(); s++) {
+        const int chr_id = chr_ids[s];
+        if(chr_id == -1)
+            continue;
+        const AnnotationIndex& index = annotations[s]->index;
+        const op_list& ops = annotations[s]->ops;
+        const ChrAnnotations& ants = index.chrs[chr_id];
+        double* sums = nullptr;
+        if(keep_order) {
+            sums = new double[ants.size()*num_tracks*ops.size()];
+            group->annotation_sums[s][chr_id] = sums;
+        }
+        sum_annotations<T>(group->coverages, num_tracks, ants, hdr->target_len[tid], ops, s == 0?&group->tracks:nullptr, &group->afps[s*num_tracks], sums);
+        group->annotation_chrs_seen[s][chr_id] = true;
+        if(index.has_groups())
+            sum_name_groups(group->coverages, num_tracks, index.group_segments[chr_id], group->name_group_sums.data());
+    }
+    std::free(group->coverages);
+    group->coverages = nullptr;
+    group->coverages_len = 0;
+}
 
+template <typename T>
+int go_bam(const char* bam_arg, int argc, const char** argv, htsFile *bam_fh, int nthreads, bool keep_order, bool has_annotation, const annotation_sets& annotations, const char* prefix, bool sum_annotation, FILE* auc_file) {
+    //only calculate AUC across either the BAM or the BigWig, but could be restricting to an annotation as well
     std::cerr << "Processing BAM: \"" << bam_arg << "\"" << std::endl;
 
     bam_hdr_t *hdr = sam_hdr_read(bam_fh);
@@ -1529,6 +3244,14 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
         print_header(hdr);
     }
     hts_set_threads(bam_fh, nthreads);
+    //resolve annotated chromosomes once rather than by name per chromosome per group
+    //(one ID per annotation set, starting at tid*num_annotation_sets)
+    const int num_annotation_sets = annotations.size();
+    std::vector<int> tid2annotation(hdr->n_targets*num_annotation_sets);
+    for(int32_t tid = 0; tid < hdr->n_targets; tid++) {
+        for(int s = 0; s < num_annotation_sets; s++)
+            tid2annotation[tid*num_annotation_sets + s] = annotations[s]->index.get_id(hdr->target_name[tid]);
+    }
     
     
     //setup list of callbacks for the process_cigar()
@@ -1578,13 +3301,25 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     //largest human chromosome is ~249M bases
     //long chr_size = 250000000;
     long chr_size = -1;
-    uint32_t* coverages = nullptr;
-    uint32_t* unique_coverages = nullptr;
+    coverage_tracks tracks;
+    int num_tracks = 0;
+    //just one group (the whole BAM) unless splitting by read group
+    std::vector<CoverageGroup*> groups;
+    bool split_by_rg = false;
+    hashmap<std::string, int> rg2group;
+    //alignments come in runs from the same read group so check the last one first
+    std::string last_rg;
+    int last_group = -1;
     bool compute_coverage = false;
     int bw_unique_min_qual = 0;
+    std::vector<int> min_unique_quals;
+    //index of the first --min-unique-qual track
+    const int first_unique_track = ALL_TRACK + 1;
+    //plus strand track, minus strand is the one after
+    int plus_strand_track = -1;
+    StrandType library_type = unstranded;
     read2len overlapping_mates;
-    bigWigFile_t *bwfp = nullptr;
-    bigWigFile_t *ubwfp = nullptr;
+    UmiDedup* umi_dedup = nullptr;
     //--coverage -> output perbase coverage to STDOUT (compute_coverage=true)
     //--bigwig -> output perbase coverage to bigwig (compute_coverage=true),
     //  this option overrides --coverage=>coverage will be *only* written to the bigwig 
@@ -1605,37 +3340,75 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     FILE* cov_fh = stdout;
     
     bool unique = has_option(argv, argv+argc, "--min-unique-qual");
-    FILE* uafp = nullptr;
     if(coverage_opt || auc_opt || annotation_opt || bigwig_opt) {
         compute_coverage = true;
         chr_size = get_longest_target_size(hdr);
-        coverages = new uint32_t[chr_size];
-        if(bigwig_opt) {
-            bwfp = create_bigwig_file(hdr, prefix,"all.bw");
-        }
+        tracks.push_back(CoverageTrack("all", "ALL_READS"));
         if(unique) {
-            if(annotation_opt) {
-                uafp = stdout;
-                if(has_option(argv, argv+argc, "--no-annotation-stdout")) {
-                    char afn[1024];
-                    sprintf(afn, "%s.unique.tsv", prefix);
-                    uafp = fopen(afn, "w");
+            if(parse_min_unique_quals(*(get_option(argv, argv+argc, "--min-unique-qual")), &min_unique_quals) != 0)
+                return -1;
+            //with a single threshold keep the original output names
+            if(min_unique_quals.size() == 1)
+                tracks.push_back(CoverageTrack("unique", "UNIQUE_READS"));
+            else {
+                for(auto const min_qual : min_unique_quals) {
+                    char name[64];
+                    sprintf(name, "unique.q%d", min_qual);
+                    char label[64];
+                    sprintf(label, "UNIQUE_READS_Q%d", min_qual);
+                    tracks.push_back(CoverageTrack(name, label));
                 }
             }
-            if(bigwig_opt)
-                ubwfp = create_bigwig_file(hdr, prefix, "unique.bw");
-            bw_unique_min_qual = atoi(*(get_option(argv, argv+argc, "--min-unique-qual")));
-            unique_coverages = new uint32_t[chr_size];
+            //--read-ends only counts alignments passing the first threshold
+            bw_unique_min_qual = min_unique_quals[0];
+        }
+        if(has_option(argv, argv+argc, "--stranded")) {
+            library_type = get_strand_type(*(get_option(argv, argv+argc, "--stranded")));
+            if(library_type == unknown_strandedness) {
+                std::cerr << "ERROR: --stranded takes one of fr-firststrand, fr-secondstrand, or unstranded" << std::endl;
+                return -1;
+            }
+            if(library_type != unstranded) {
+                plus_strand_track = tracks.size();
+                tracks.push_back(CoverageTrack("plus", "PLUS_STRAND_READS"));
+                tracks.push_back(CoverageTrack("minus", "MINUS_STRAND_READS"));
+            }
+        }
+        num_tracks = tracks.size();
+        //every track is a bit of an alignment's track mask
+        if(num_tracks > MAX_COVERAGE_TRACKS) {
+            fprintf(stderr, "ERROR: at most %d coverage tracks are supported (the whole BAM, each --min-unique-qual threshold & 2 for --stranded), %d were asked for\n",
+                    MAX_COVERAGE_TRACKS, num_tracks);
+            return -1;
+        }
+        if(has_option(argv, argv+argc, "--umi-dedup")) {
+            umi_dedup = new UmiDedup();
+            umi_dedup->tag = *(get_option(argv, argv+argc, "--umi-dedup"));
+            umi_dedup->allow_mismatch = has_option(argv, argv+argc, "--umi-mismatch");
+            umi_dedup->tid = -1;
+            umi_dedup->pos = -1;
+            umi_dedup->duplicates = 0;
+        }
+        if(has_option(argv, argv+argc, "--split-by")) {
+            const char* split_by = *(get_option(argv, argv+argc, "--split-by"));
+            if(!split_by || strcmp(split_by, "RG") != 0) {
+                std::cerr << "ERROR: --split-by only supports RG" << std::endl;
+                return -1;
+            }
+            split_by_rg = true;
         }
         if(coverage_opt && !bigwig_opt && has_option(argv, argv+argc, "--no-coverage-stdout")) {
             char cov_fn[1024];
             sprintf(cov_fn, "%s.coverage.tsv", prefix);
             cov_fh = fopen(cov_fn,"w");
         }
+        //read groups are added as they're first seen
+        if(!split_by_rg)
+            groups.push_back(create_coverage_group("", tracks, hdr, prefix, bigwig_opt, annotation_opt, 
+                                                   has_option(argv, argv+argc, "--no-annotation-stdout"), true, cov_fh, annotations));
     }
     fraglen2count* frag_dist = new fraglen2count(1);
     mate2len* frag_mates = new mate2len(1);
-    char cov_prefix[50]="";
     int32_t ptid = -1;
     uint32_t* starts = nullptr;
     uint32_t* ends = nullptr;
@@ -1735,36 +3508,78 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
                 if(tid != ptid) {
                     if(ptid != -1) {
                         overlapping_mates.clear();
-                        sprintf(cov_prefix, "cov\t%d", ptid);
-                        if(coverage_opt || bigwig_opt || auc_opt) {
-                            all_auc += print_array(cov_prefix, hdr->target_name[ptid], coverages, hdr->target_len[ptid], false, bwfp, cov_fh, dont_output_coverage);
-                            if(unique) {
-                                sprintf(cov_prefix, "ucov\t%d", ptid);
-                                unique_auc += print_array(cov_prefix, hdr->target_name[ptid], unique_coverages, hdr->target_len[ptid], false, ubwfp, cov_fh, dont_output_coverage);
-                            }
-                        }
-                        //if we also want to sum coverage across a user supplied file of annotated regions
-                        int keep_order_idx = keep_order?2:-1;
-                        if(sum_annotation && annotations->find(hdr->target_name[ptid]) != annotations->end()) {
-                            sum_annotations(coverages, (*annotations)[hdr->target_name[ptid]], hdr->target_len[ptid], hdr->target_name[ptid], afp, &annotated_auc, !annotation_opt, keep_order_idx);
-                            if(unique) {
-                                keep_order_idx = keep_order?3:-1;
-                                sum_annotations(unique_coverages, (*annotations)[hdr->target_name[ptid]], hdr->target_len[ptid], hdr->target_name[ptid], uafp, &unique_annotated_auc, !annotation_opt, keep_order_idx);
+                        for(auto group : groups)
+                            finish_group_chromosome<T>(group, num_tracks, hdr, ptid, annotations, &tid2annotation[ptid*num_annotation_sets], coverage_opt || bigwig_opt || auc_opt,
+                                                    dont_output_coverage, sum_annotation, keep_order);
+                    }
+                }
+                int gidx = 0;
+                if(split_by_rg) {
+                    const uint8_t* rgp = bam_aux_get(rec, "RG");
+                    const char* rg = rgp?bam_aux2Z(rgp):nullptr;
+                    if(!rg)
+                        rg = NO_READ_GROUP;
+                    if(last_group == -1 || strcmp(rg, last_rg.c_str()) != 0) {
+                        auto it = rg2group.find(rg);
+                        if(it == rg2group.end()) {
+                            CoverageGroup* new_group = create_coverage_group(rg, tracks, hdr, prefix, bigwig_opt, annotation_opt, true, false, nullptr, annotations);
+                            //named from the group's prefix, which has any '/' in the RG replaced
+                            if(coverage_opt && !bigwig_opt) {
+                                char cov_fn[1024];
+                                snprintf(cov_fn, sizeof(cov_fn), "%s.coverage.tsv", new_group->file_prefix.c_str());
+                                new_group->cov_fh = fopen(cov_fn, "w");
+                                if(!new_group->cov_fh) {
+                                    fprintf(stderr, "ERROR: couldn't open %s for read group %s's coverage\n", cov_fn, rg);
+                                    return -1;
+                                }
                             }
-                            if(!keep_order)
-                                annotation_chrs_seen->insert(hdr->target_name[ptid]);
+                            it = rg2group.emplace(rg, groups.size()).first;
+                            groups.push_back(new_group);
                         }
+                        last_rg = rg;
+                        last_group = it->second;
+                    }
+                    gidx = last_group;
+                }
+                CoverageGroup* group = groups[gidx];
+                //duplicates are left out of coverage (and so AUCs & annotation sums) only
+                if(!umi_dedup || !is_umi_duplicate(rec, gidx, umi_dedup)) {
+                    //lazily allocated so groups w/o alignments on this chromosome take no memory,
+                    //sized to this chromosome and only grown for an alignment hanging off its end
+                    const long needed_len = std::max((long) hdr->target_len[tid], (long) bam_endpos(rec));
+                    if(!group->coverages) {
+                        group->coverages = (uint32_t*) std::calloc(needed_len*num_tracks, sizeof(uint32_t));
+                        group->coverages_len = needed_len;
+                    }
+                    else if(needed_len > group->coverages_len) {
+                        group->coverages = (uint32_t*) std::realloc(group->coverages, needed_len*num_tracks*sizeof(uint32_t));
+                        if(group->coverages)
+                            std::memset(group->coverages + group->coverages_len*num_tracks, 0,
+                                        (needed_len - group->coverages_len)*num_tracks*sizeof(uint32_t));
+                        group->coverages_len = needed_len;
                     }
-                    reset_array(coverages, chr_size);
-                    if(unique)
-                        reset_array(unique_coverages, chr_size);
+                    if(!group->coverages) {
+                        fprintf(stderr, "ERROR: couldn't allocate coverage for %s (%ld bases) for %s\n",
+                                hdr->target_name[tid], needed_len, group->id.empty()?"the BAM":group->id.c_str());
+                        return -1;
+                    }
+                    //decide once per alignment which MAPQ tracks it counts toward
+                    //so the CIGAR walk is shared across all of them
+                    uint32_t track_mask = 1u << ALL_TRACK;
+                    for(int q = 0; q < min_unique_quals.size(); q++) {
+                        if(c->qual >= min_unique_quals[q])
+                            track_mask |= 1u << (first_unique_track + q);
+                    }
+                    //both mates of a pair land on the same strand track
+                    if(plus_strand_track != -1)
+                        track_mask |= 1u << (fragment_on_plus_strand(rec, library_type)?plus_strand_track:plus_strand_track+1);
+                    end_refpos = calculate_coverage(rec, group->coverages, num_tracks, track_mask, double_count, &overlapping_mates, &total_intron_len);
                 }
-                end_refpos = calculate_coverage(rec, coverages, unique_coverages, double_count, bw_unique_min_qual, &overlapping_mates, &total_intron_len);
             }
             //additional counting options which make use of knowing the end coordinate/maplen
             //however, if we're already running calculate_coverage, we don't need to redo this
             if(end_refpos == -1 && (report_end_coord || print_frag_dist))
-                end_refpos = calculate_coverage(rec, nullptr, nullptr, double_count, bw_unique_min_qual, nullptr, &total_intron_len);
+                end_refpos = calculate_coverage(rec, nullptr, 0, 0, double_count, nullptr, &total_intron_len);
 
             if(report_end_coord)
                 fprintf(stdout, "%s\t%d\n", qname, end_refpos);
@@ -1954,45 +3769,50 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     }
     if(compute_coverage) {
         if(ptid != -1) {
-            sprintf(cov_prefix, "cov\t%d", ptid);
-            if(coverage_opt || bigwig_opt || auc_opt) {
-                all_auc += print_array(cov_prefix, hdr->target_name[ptid], coverages, hdr->target_len[ptid], false, bwfp, cov_fh, dont_output_coverage);
-                if(unique) {
-                    sprintf(cov_prefix, "ucov\t%d", ptid);
-                    unique_auc += print_array(cov_prefix, hdr->target_name[ptid], unique_coverages, hdr->target_len[ptid], false, ubwfp, cov_fh, dont_output_coverage);
-                }
+            for(auto group : groups) {
+                finish_group_chromosome<T>(group, num_tracks, hdr, ptid, annotations, &tid2annotation[ptid*num_annotation_sets], coverage_opt || bigwig_opt || auc_opt,
+                                        dont_output_coverage, sum_annotation, keep_order);
+                //if we wanted to keep the chromosome order of the annotation output matching the input BED file
+                for(int s = 0; sum_annotation && keep_order && s < num_annotation_sets; s++)
+                    output_all_coverage_ordered_by_BED<T>(&annotations[s]->index, &group->afps[s*num_tracks], num_tracks, annotations[s]->ops,
+                                                          &group->annotation_sums[s], &group->annotation_chrs_seen[s]);
             }
-            if(sum_annotation && annotations->find(hdr->target_name[ptid]) != annotations->end()) {
-                int keep_order_idx = keep_order?2:-1;
-                sum_annotations(coverages, (*annotations)[hdr->target_name[ptid]], hdr->target_len[ptid], hdr->target_name[ptid], afp, &annotated_auc, false, keep_order_idx);
-                if(unique) {
-                    keep_order_idx = keep_order?3:-1;
-                    sum_annotations(unique_coverages, (*annotations)[hdr->target_name[ptid]], hdr->target_len[ptid], hdr->target_name[ptid], uafp, &unique_annotated_auc, false, keep_order_idx);
+        }
+        //read group AUCs are reported w/ the group's ID in a 3rd column
+        if(sum_annotation && auc_file) {
+            for(auto group : groups) {
+                for(auto const& track : group->tracks) {
+                    fprintf(auc_file, "%s_ANNOTATED_BASES\t%" PRIu64, track.auc_label.c_str(), track.annotated_auc);
+                    fprintf(auc_file, group->id.empty()?"\n":"\t%s\n", group->id.c_str());
                 }
-                if(!keep_order)
-                    annotation_chrs_seen->insert(hdr->target_name[ptid]);
             }
-            //if we wanted to keep the chromosome order of the annotation output matching the input BED file
-            if(keep_order)
-                output_all_coverage_ordered_by_BED(chrm_order, annotations, afp, uafp);
         }
-        if(sum_annotation && auc_file) {
-            fprintf(auc_file, "ALL_READS_ANNOTATED_BASES\t%" PRIu64 "\n", annotated_auc);
-            if(unique)
-                fprintf(auc_file, "UNIQUE_READS_ANNOTATED_BASES\t%" PRIu64 "\n", unique_annotated_auc);
+        if(sum_annotation && annotations[0]->index.has_groups()) {
+            for(auto group : groups) {
+                for(int t = 0; t < num_tracks; t++) {
+                    char gfn[1024];
+                    sprintf(gfn, "%s.%s.by_name.tsv", group->file_prefix.c_str(), t == ALL_TRACK?"annotation":group->tracks[t].name.c_str());
+                    FILE* gfp = fopen(gfn, "w");
+                    output_name_groups(&annotations[0]->index, group->name_group_sums.data(), num_tracks, t, gfp);
+                    fclose(gfp);
+                }
+            }
         }
-        delete[] coverages;
-        if(unique)
-            delete[] unique_coverages;
         if(sum_annotation && !keep_order) {
-            output_missing_annotations(annotations, annotation_chrs_seen, afp);
-            if(unique)
-                output_missing_annotations(annotations, annotation_chrs_seen, uafp);
+            for(auto group : groups) {
+                for(int s = 0; s < num_annotation_sets; s++) {
+                    for(int t = 0; t < num_tracks; t++)
+                        output_missing_annotations<T>(&annotations[s]->index, &group->annotation_chrs_seen[s], group->afps[s*num_tracks + t], annotations[s]->ops);
+                }
+            }
         }
         if(auc_file) {
-            fprintf(auc_file, "ALL_READS_ALL_BASES\t%" PRIu64 "\n", all_auc);
-            if(unique)
-                fprintf(auc_file, "UNIQUE_READS_ALL_BASES\t%" PRIu64 "\n", unique_auc);
+            for(auto group : groups) {
+                for(auto const& track : group->tracks) {
+                    fprintf(auc_file, "%s_ALL_BASES\t%" PRIu64, track.auc_label.c_str(), track.auc);
+                    fprintf(auc_file, group->id.empty()?"\n":"\t%s\n", group->id.c_str());
+                }
+            }
         }
     }
     if(compute_ends) {
@@ -2007,15 +3827,29 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
         delete[] starts;
         delete[] ends;
     }
-    if(bwfp) {
-        bwClose(bwfp);
-        if(!ubwfp)
-            bwCleanup();
-    }
-    if(ubwfp) {
-        bwClose(ubwfp);
-            bwCleanup();
+    bool opened_bigwigs = false;
+    for(auto group : groups) {
+        for(auto const& track : group->tracks) {
+            if(track.bwfp) {
+                bwClose(track.bwfp);
+                opened_bigwigs = true;
+            }
+        }
+        for(int i = 0; i < group->afps.size(); i++) {
+            FILE* gafp = group->afps[i];
+            if(gafp && gafp != stdout && gafp != annotations[i / num_tracks]->afp)
+                fclose(gafp);
+        }
+        if(group->cov_fh && group->cov_fh != stdout && group->cov_fh != cov_fh)
+            fclose(group->cov_fh);
+        for(auto const& set_sums : group->annotation_sums) {
+            for(auto sums : set_sums)
+                delete[] sums;
+        }
+        delete group;
     }
+    if(opened_bigwigs)
+        bwCleanup();
     if(cov_fh && cov_fh != stdout)
         fclose(cov_fh);
     if(rsfp)
@@ -2026,11 +3860,15 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
         alts_file.close();
     if(auc_file && auc_file != stdout)
         fclose(auc_file);
-    if(afp && afp != stdout)
-        fclose(afp);
-    if(uafp)
-        fclose(uafp);
+    for(auto set : annotations) {
+        if(set->afp && set->afp != stdout)
+            fclose(set->afp);
+    }
     fprintf(stderr,"Read %" PRIu64 " records\n",recs);
+    if(umi_dedup) {
+        fprintf(stderr,"%" PRIu64 " UMI duplicate alignments left out of coverage\n",umi_dedup->duplicates);
+        delete umi_dedup;
+    }
     if(count_bases) {
         fprintf(stdout,"%" PRIu64 " records passed filters\n",reads_processed);
         fprintf(stdout,"%" PRIu64 " bases in alignments which passed filters\n",*((uint64_t*) maplen_outlist[0]));
@@ -2044,8 +3882,285 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     return 0;
 }
 
+//--barcode-counts: counts of alignments per cell barcode over each annotated interval
+//kept sparsely as (interval row, barcode) -> count rather than in per-base coverage arrays
+//overlap query state for the (start sorted) annotated intervals of one chromosome
+struct BarcodeIntervals {
+    //output row of the chromosome's first interval
+    uint64_t row_offset;
+    long max_len;
+};
+
+//one per thread, barcode & UMI IDs are local to it until merged
+struct BarcodeCounter {
+    str2int barcode_ids;
+    strvec barcodes;
+    str2int umi_ids;
+    //(row << 32 | barcode ID) -> count
+    hashmap<uint64_t, uint32_t> counts;
+    //(row << 32 | barcode ID) -> distinct UMI IDs, if counting UMIs rather than alignments
+    hashmap<uint64_t, hashset<uint32_t>> umis;
+};
+
+static inline int get_local_id(const char* key, str2int* ids, strvec* keys) {
+    auto it = ids->find(key);
+    if(it != ids->end())
+        return it->second;
+    int id = ids->size();
+    ids->emplace(key, id);
+    if(keys)
+        keys->push_back(key);
+    return id;
+}
+
+static BarcodeIntervals* index_barcode_intervals(const ChrAnnotations& ants, uint64_t row_offset) {
+    BarcodeIntervals* bi = new BarcodeIntervals();
+    bi->row_offset = row_offset;
+    bi->max_len = 0;
+    for(uint32_t z = 0; z < ants.size(); z++) {
+        if((long) ants.ends[z] - (long) ants.starts[z] > bi->max_len)
+            bi->max_len = (long) ants.ends[z] - (long) ants.starts[z];
+    }
+    return bi;
+}
+
+//intersects the aligned blocks of an alignment with the annotation and counts it once
+//for every interval it overlaps under its cell barcode
+static void count_barcode_alignment(const bam1_t* rec, const ChrAnnotations& ants, const BarcodeIntervals* bi,
+                                    const char* barcode_tag, const char* umi_tag, BarcodeCounter* counter,
+                                    std::vector<uint32_t>* hits) {
+    const uint8_t* bcp = bam_aux_get(rec, barcode_tag);
+    const char* barcode = bcp?bam_aux2Z(bcp):nullptr;
+    if(!barcode)
+        return;
+    const char* umi = nullptr;
+    if(umi_tag) {
+        const uint8_t* up = bam_aux_get(rec, umi_tag);
+        umi = up?bam_aux2Z(up):nullptr;
+        if(!umi)
+            return;
+    }
+    hits->clear();
+    const uint32_t* cigar = bam_get_cigar(rec);
+    long pos = rec->core.pos;
+    for(uint32_t k = 0; k < rec->core.n_cigar; k++) {
+        const int type = bam_cigar_type(bam_cigar_op(cigar[k]));
+        if(!(type & 2))
+            continue;
+        const long len = bam_cigar_oplen(cigar[k]);
+        if(type & 1) {
+            const long bend = pos + len;
+            //no interval starting before this could reach the block
+            const long min_start = pos - bi->max_len;
+            const uint32_t* end = ants.starts + ants.size();
+            const uint32_t* it = std::lower_bound(ants.starts, end, min_start,
+                                                  [](uint32_t start, long v) { return (long) start < v; });
+            for(; it != end && (long) *it < bend; it++) {
+                const uint32_t z = it - ants.starts;
+                if((long) ants.ends[z] > pos)
+                    hits->push_back(z);
+            }
+        }
+        pos += len;
+    }
+    if(hits->empty())
+        return;
+    //spliced alignments can hit the same interval from more than one block
+    std::sort(hits->begin(), hits->end());
+    hits->erase(std::unique(hits->begin(), hits->end()), hits->end());
+    const uint64_t barcode_id = get_local_id(barcode, &counter->barcode_ids, &counter->barcodes);
+    const uint32_t umi_id = umi?get_local_id(umi, &counter->umi_ids, nullptr):0;
+    for(auto const z : *hits) {
+        //rows are in BED order, a duplicated interval counts toward each of its rows
+        for(uint32_t r = ants.row_offsets[z]; r < ants.row_offsets[z+1]; r++) {
+            const uint64_t key = ((bi->row_offset + ants.rows[r]) << 32) | barcode_id;
+            if(umi)
+                counter->umis[key].insert(umi_id);
+            else
+                counter->counts[key]++;
+        }
+    }
+}
+
+static inline bool skip_barcode_alignment(const bam1_t* rec) {
+    return (rec->core.flag & BAM_FUNMAP) != 0 || (rec->core.flag & BAM_FSECONDARY) != 0;
+}
+
+//pulls chromosomes off the shared list and queries them through the BAM index
+//w/ its own file handle
+static void barcode_counts_worker(const char* bam_fn, const std::vector<const ChrAnnotations*>* tid2ants,
+                                  const std::vector<BarcodeIntervals*>* tid2intervals, const std::vector<int32_t>* tids,
+                                  std::atomic<int>* next_tid, const char* barcode_tag, const char* umi_tag, BarcodeCounter* counter) {
+    htsFile* fp = sam_open(bam_fn, "r");
+    bam_hdr_t* hdr = fp?sam_hdr_read(fp):nullptr;
+    hts_idx_t* idx = hdr?sam_index_load(fp, bam_fn):nullptr;
+    if(!idx) {
+        fprintf(stderr, "ERROR: could not open %s with its index in barcode counting thread\n", bam_fn);
+        return;
+    }
+    bam1_t* rec = bam_init1();
+    std::vector<uint32_t> hits;
+    int i;
+    while((i = (*next_tid)++) < tids->size()) {
+        const int32_t tid = (*tids)[i];
+        hts_itr_t* itr = sam_itr_queryi(idx, tid, 0, hdr->target_len[tid]);
+        while(itr && sam_itr_next(fp, itr, rec) >= 0) {
+            if(!skip_barcode_alignment(rec))
+                count_barcode_alignment(rec, *((*tid2ants)[tid]), (*tid2intervals)[tid], barcode_tag, umi_tag, counter, &hits);
+        }
+        if(itr)
+            hts_itr_destroy(itr);
+    }
+    bam_destroy1(rec);
+    hts_idx_destroy(idx);
+    bam_hdr_destroy(hdr);
+    sam_close(fp);
+}
+
+typedef std::vector<uint32_t> sparse_entry;
+int go_barcodes(const char* bam_arg, int argc, const char** argv, htsFile *bam_fh, int nthreads, const AnnotationIndex* annotations, const char* prefix) {
+    const char* barcode_tag = "CB";
+    if(has_option(argv, argv+argc, "--barcode-tag"))
+        barcode_tag = *(get_option(argv, argv+argc, "--barcode-tag"));
+    const char* umi_tag = nullptr;
+    if(has_option(argv, argv+argc, "--umi-tag"))
+        umi_tag = *(get_option(argv, argv+argc, "--umi-tag"));
+    bam_hdr_t *hdr = sam_hdr_read(bam_fh);
+    if(!hdr) {
+        std::cerr << "ERROR: Could not read header for " << bam_arg
+                  << ": " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    //rows are the intervals in BED order
+    std::vector<uint64_t> row_offsets;
+    uint64_t num_rows = 0;
+    for(auto const& chr : annotations->chrs) {
+        row_offsets.push_back(num_rows);
+        num_rows += chr.num_rows;
+    }
+    std::vector<const ChrAnnotations*> tid2ants(hdr->n_targets, nullptr);
+    std::vector<BarcodeIntervals*> tid2intervals(hdr->n_targets, nullptr);
+    std::vector<int32_t> tids;
+    for(int32_t tid = 0; tid < hdr->n_targets; tid++) {
+        const int chr_id = annotations->get_id(hdr->target_name[tid]);
+        if(chr_id == -1)
+            continue;
+        tid2ants[tid] = &(annotations->chrs[chr_id]);
+        tid2intervals[tid] = index_barcode_intervals(annotations->chrs[chr_id], row_offsets[chr_id]);
+        tids.push_back(tid);
+    }
+    //multi-threaded by chromosome if there's an index to query each one with
+    hts_idx_t* idx = nthreads > 1?sam_index_load(bam_fh, bam_arg):nullptr;
+    if(nthreads > 1 && !idx)
+        fprintf(stderr, "WARNING: no index found for %s, counting barcodes w/ a single thread\n", bam_arg);
+    std::vector<BarcodeCounter*> counters;
+    if(idx) {
+        hts_idx_destroy(idx);
+        //largest chromosomes first
+        std::sort(tids.begin(), tids.end(), [hdr](int32_t a, int32_t b) { return hdr->target_len[a] > hdr->target_len[b]; });
+        std::atomic<int> next_tid(0);
+        std::vector<std::thread> threads;
+        for(int i = 0; i < nthreads; i++) {
+            counters.push_back(new BarcodeCounter());
+            threads.push_back(std::thread(barcode_counts_worker, bam_arg, &tid2ants, &tid2intervals, &tids, &next_tid,
+                                          barcode_tag, umi_tag, counters.back()));
+        }
+        for(auto &t: threads) t.join();
+    }
+    else {
+        hts_set_threads(bam_fh, nthreads);
+        counters.push_back(new BarcodeCounter());
+        bam1_t *rec = bam_init1();
+        std::vector<uint32_t> hits;
+        while(sam_read1(bam_fh, hdr, rec) >= 0) {
+            const int32_t tid = rec->core.tid;
+            if(skip_barcode_alignment(rec) || tid < 0 || !tid2ants[tid])
+                continue;
+            count_barcode_alignment(rec, *(tid2ants[tid]), tid2intervals[tid], barcode_tag, umi_tag, counters[0], &hits);
+        }
+        bam_destroy1(rec);
+    }
+    //merge the per-thread barcode IDs into one sorted set of columns
+    strvec barcodes;
+    for(auto counter : counters)
+        barcodes.insert(barcodes.end(), counter->barcodes.begin(), counter->barcodes.end());
+    std::sort(barcodes.begin(), barcodes.end());
+    barcodes.erase(std::unique(barcodes.begin(), barcodes.end()), barcodes.end());
+    str2int barcode2col;
+    for(uint32_t i = 0; i < barcodes.size(); i++)
+        barcode2col[barcodes[i]] = i;
+    //each chromosome was counted by one thread so there are no entries to combine
+    std::vector<sparse_entry> entries;
+    for(auto counter : counters) {
+        std::vector<uint32_t> local2col;
+        for(auto const& b : counter->barcodes)
+            local2col.push_back(barcode2col[b]);
+        for(auto const& kv : counter->counts)
+            entries.push_back({(uint32_t) (kv.first >> 32), local2col[kv.first & 0xFFFFFFFF], kv.second});
+        for(auto const& kv : counter->umis)
+            entries.push_back({(uint32_t) (kv.first >> 32), local2col[kv.first & 0xFFFFFFFF], (uint32_t) kv.second.size()});
+        delete counter;
+    }
+    //column (barcode) major, then row
+    std::sort(entries.begin(), entries.end(), [](const sparse_entry& a, const sparse_entry& b) {
+                                                    return a[1] < b[1] || (a[1] == b[1] && a[0] < b[0]); });
+    char afn[1024];
+    sprintf(afn, "%s.barcodes.tsv", prefix);
+    FILE* bfp = fopen(afn, "w");
+    if(!bfp) {
+        fprintf(stderr, "ERROR: could not write %s\n", afn);
+        return -1;
+    }
+    for(auto const& b : barcodes)
+        fprintf(bfp, "%s\n", b.c_str());
+    fclose(bfp);
+    sprintf(afn, "%s.features.tsv", prefix);
+    FILE* ffp = fopen(afn, "w");
+    if(!ffp) {
+        fprintf(stderr, "ERROR: could not write %s\n", afn);
+        return -1;
+    }
+    for(auto const& chr : annotations->chrs) {
+        for(uint32_t i = 0; i < chr.num_rows; i++)
+            fprintf(ffp, "%s\t%u\t%u\n", chr.name.c_str(), chr.starts[chr.order[i]], chr.ends[chr.order[i]]);
+    }
+    fclose(ffp);
+    if(has_option(argv, argv+argc, "--barcode-binary")) {
+        //magic, # rows, # columns, # entries (uint64_t each), then row, column, count (uint32_t each)
+        //per entry, all little-endian, rows/columns 0-based
+        sprintf(afn, "%s.barcodes.bin", prefix);
+        FILE* mfp = fopen(afn, "wb");
+        if(!mfp) {
+            fprintf(stderr, "ERROR: could not write %s\n", afn);
+            return -1;
+        }
+        const uint64_t header[4] = { BARCODE_MATRIX_MAGIC, num_rows, barcodes.size(), entries.size() };
+        fwrite(header, sizeof(uint64_t), 4, mfp);
+        for(auto const& e : entries)
+            fwrite(e.data(), sizeof(uint32_t), 3, mfp);
+        fclose(mfp);
+    }
+    else {
+        sprintf(afn, "%s.barcodes.mtx", prefix);
+        FILE* mfp = fopen(afn, "w");
+        if(!mfp) {
+            fprintf(stderr, "ERROR: could not write %s\n", afn);
+            return -1;
+        }
+        fprintf(mfp, "%%%%MatrixMarket matrix coordinate integer general\n");
+        fprintf(mfp, "%" PRIu64 " %zu %zu\n", num_rows, barcodes.size(), entries.size());
+        for(auto const& e : entries)
+            fprintf(mfp, "%u %u %u\n", e[0]+1, e[1]+1, e[2]);
+        fclose(mfp);
+    }
+    for(auto bi : tid2intervals)
+        delete bi;
+    fprintf(stderr, "%zu barcodes w/ %zu non-zero interval counts\n", barcodes.size(), entries.size());
+    return 0;
+}
+
 template <typename T>
-int go(const char* fname_arg, int argc, const char** argv, Op op, htsFile *bam_fh, bool is_bam) {
+int go(const char* fname_arg, int argc, const char** argv, const op_list& ops, htsFile *bam_fh, bool is_bam) {
     //number of bam decompression threads
     //0 == 1 thread for the whole program,fname_arg//decompression shares a single core with processing
     //This can also indicate the number of parallel threads to process a list of BigWigs for
@@ -2056,13 +4171,18 @@ int go(const char* fname_arg, int argc, const char** argv, Op op, htsFile *bam_f
         nthreads = atoi(*nthreads_);
     }
     bool keep_order = !has_option(argv, argv+argc, "--keep-order");
-    strlist chrm_order;
-    FILE* afp = nullptr;
-    annotation_map_t<T> annotations; 
+    if(SUMS_BINARY >= 0) {
+        if(is_bam) {
+            std::cerr << "ERROR: --sums-binary is only for BigWig input" << std::endl;
+            return -1;
+        }
+        //its values are in BED order
+        keep_order = true;
+    }
+    annotation_sets annotations;
     bool sum_annotation = false;
-    chr2bool annotation_chrs_seen;
-    //setup hashmap to store BED file of *non-overlapping* annotated intervals to sum coverage across
-    //maps chromosome to vector of uint arrays storing start/end of annotated intervals
+    //setup index to store BED file of *non-overlapping* annotated intervals to sum coverage across
+    //maps chromosome to contiguous arrays of the start/end of annotated intervals
     int err = 0;
     bool has_annotation = has_option(argv, argv+argc, "--annotation");
     bool no_annotation_stdout = has_option(argv, argv+argc, "--no-annotation-stdout");
@@ -2071,23 +4191,99 @@ int go(const char* fname_arg, int argc, const char** argv, Op op, htsFile *bam_f
             prefix = *(get_option(argv, argv+argc, "--prefix"));
     if(has_annotation) {
         sum_annotation = true;
-        const char* afile = *(get_option(argv, argv+argc, "--annotation"));
-        if(!afile) {
-            std::cerr << "No argument to --annotation" << std::endl;
+        //the name groups are only summed from BAM coverage
+        if(!is_bam && has_option(argv, argv+argc, "--aggregate-by-name")) {
+            std::cerr << "ERROR: --aggregate-by-name is only supported for BAM input" << std::endl;
             return -1;
         }
-        afp = fopen(afile, "r");
-        err = read_annotation(afp, &annotations, &chrm_order, keep_order);
-        fclose(afp);
-        
-        afp = stdout;
-        if(no_annotation_stdout) {
-            char afn[1024];
-            sprintf(afn, "%s.annotation.tsv", prefix);
-            afp = fopen(afn, "w");
+        //--annotation can be repeated, each as <bed>[,<label>[,<op>...]]
+        std::vector<const char*> annotation_args;
+        get_options(argv, argv+argc, "--annotation", &annotation_args);
+        for(int i = 0; i < annotation_args.size() && err == 0; i++) {
+            if(!annotation_args[i]) {
+                std::cerr << "No argument to --annotation" << std::endl;
+                return -1;
+            }
+            strvec fields;
+            split_string(annotation_args[i], ',', &fields);
+            const char* afile = fields[0].c_str();
+            AnnotationSet* set = new AnnotationSet();
+            annotations.push_back(set);
+            set->ops = ops;
+            if(fields.size() > 2) {
+                set->ops.clear();
+                if(parse_ops(fields, 2, &set->ops) != 0)
+                    return -1;
+            }
+            //zoom level records only have the sum, min & max (the mean's from the sum)
+            if(!is_bam && APPROXIMATE_MIN_LENGTH > 0
+                    && (std::find(set->ops.begin(), set->ops.end(), cmedian) != set->ops.end()
+                        || std::find(set->ops.begin(), set->ops.end(), cbases) != set->ops.end())) {
+                std::cerr << "ERROR: --approximate only supports the sum, mean, min & max ops" << std::endl;
+                return -1;
+            }
+            //later annotations w/o a label are named after their BED file, less its extension (and any .gz)
+            if(fields.size() > 1)
+                set->label = fields[1];
+            else if(i > 0) {
+                strvec path;
+                split_string(fields[0], '/', &path);
+                std::string base = path.back();
+                if(base.size() > 3 && base.compare(base.size() - 3, 3, ".gz") == 0)
+                    base.resize(base.size() - 3);
+                set->label = base.substr(0, base.rfind('.'));
+            }
+            //each labeled annotation gets its own <prefix>.<label>.* outputs
+            for(int j = 0; j < i && !set->label.empty(); j++) {
+                if(annotations[j]->label == set->label) {
+                    std::cerr << "ERROR: --annotation " << annotation_args[i] << " has the same label (" << set->label
+                              << ") as an earlier --annotation, pass a distinct one as <bed>,<label>" << std::endl;
+                    return -1;
+                }
+            }
+            //the cache & --aggregate-by-name only apply to the first annotation
+            const char* cache_fn = nullptr;
+            if(i == 0 && has_option(argv, argv+argc, "--annotation-cache"))
+                cache_fn = *(get_option(argv, argv+argc, "--annotation-cache"));
+            //the cache doesn't keep the name column
+            const bool aggregate_by_name = i == 0 && has_option(argv, argv+argc, "--aggregate-by-name");
+            if(cache_fn && aggregate_by_name) {
+                fprintf(stderr, "WARNING: --annotation-cache isn't used w/ --aggregate-by-name\n");
+                cache_fn = nullptr;
+            }
+            //the cache is tied to the BED file's size & modification time
+            struct stat bed_stat;
+            if(cache_fn && stat(afile, &bed_stat) != 0)
+                cache_fn = nullptr;
+            if(cache_fn)
+                load_annotation_cache(cache_fn, &bed_stat, &set->index);
+            if(set->index.empty()) {
+                err = read_annotation(afile, &set->index, nthreads, aggregate_by_name);
+                if(cache_fn && err == 0)
+                    write_annotation_cache(cache_fn, &bed_stat, &set->index);
+            }
+            else
+                std::cerr << "loaded annotation from cache " << cache_fn << "\n";
+            if(err != 0)
+                return -1;
+
+            set->afp = stdout;
+            //written to <prefix>.sums.bin instead
+            if(i == 0 && SUMS_BINARY >= 0)
+                set->afp = nullptr;
+            else if(!set->label.empty()) {
+                char afn[1024];
+                sprintf(afn, "%s.%s.tsv", prefix, set->label.c_str());
+                set->afp = fopen(afn, "w");
+            }
+            else if(no_annotation_stdout) {
+                char afn[1024];
+                sprintf(afn, "%s.annotation.tsv", prefix);
+                set->afp = fopen(afn, "w");
+            }
+            assert(!set->index.empty());
+            std::cerr << set->index.size() << " chromosomes for annotated regions read\n";
         }
-        assert(!annotations.empty());
-        std::cerr << annotations.size() << " chromosomes for annotated regions read\n";
     }
     //if no args are passed in other than a file (BAM or BW)
     //then just compute the auc 
@@ -2105,10 +4301,469 @@ int go(const char* fname_arg, int argc, const char** argv, Op op, htsFile *bam_f
     }
 
     assert(err == 0);
+    if(is_bam && has_option(argv, argv+argc, "--barcode-counts")) {
+        if(!has_annotation) {
+            std::cerr << "ERROR: --barcode-counts requires --annotation" << std::endl;
+            return -1;
+        }
+        return go_barcodes(fname_arg, argc, argv, bam_fh, nthreads, &annotations[0]->index, prefix);
+    }
     if(is_bam)
-        return go_bam(fname_arg, argc, argv, op, bam_fh, nthreads, keep_order, has_annotation, afp, &annotations, &annotation_chrs_seen, prefix, sum_annotation, &chrm_order, auc_file);
+        err = go_bam<T>(fname_arg, argc, argv, bam_fh, nthreads, keep_order, has_annotation, annotations, prefix, sum_annotation, auc_file);
+    else
+        err = go_bw<T>(fname_arg, argc, argv, bam_fh, nthreads, keep_order, has_annotation, annotations, prefix, sum_annotation, auc_file);
+    for(auto set : annotations)
+        delete set;
+    return err;
+}
+
+//aggregate merges at most this many files at once to stay under the open file limit,
+//more samples are first merged in groups of this many into temporary files, which are then merged in turn
+static const size_t AGGREGATE_MAX_OPEN_FILES = 1000;
+
+//one sample's sum file (or an earlier group merge's temporary file) being merged by aggregate, a block of rows at a time
+struct SampleSums {
+    std::string id;
+    std::string path;
+    //empty or missing, filled w/ 0's
+    bool blank = false;
+    //values per line, > 1 for a group merge's temporary file whose lines are taken whole
+    size_t columns = 1;
+    FILE* fp = nullptr;
+    long offset = 0;
+    //a --sums-binary file's encoding (-1 for text) & its last value when delta encoded
+    int encoding = -1;
+    int64_t prev = 0;
+    //the current block's values of a text file as text & where each starts
+    std::string text;
+    std::vector<uint32_t> starts;
+    //or of a --sums-binary file as read, only formatted when writing text
+    std::vector<double> doubles;
+    std::vector<int64_t> ints;
+    //adds the values of row r of the current block to vals
+    void values(long r, std::vector<double>* vals) const {
+        if(blank)
+            vals->insert(vals->end(), columns, 0.0);
+        else if(encoding == SUMS_FLOAT64)
+            vals->push_back(doubles[r]);
+        else if(encoding >= 0)
+            vals->push_back((double) ints[r]);
+        else {
+            const char* p = &text[starts[r]];
+            for(size_t c = 0; c < columns; c++) {
+                char* end;
+                vals->push_back(strtod(p, &end));
+                p = *end == '\t'?end+1:end;
+            }
+        }
+    }
+};
+
+//drops all-0 decimals w/ convert_to_int (12.000 => 12)
+static const char* trim_sums_value(const char* value, const char* end, bool convert_to_int) {
+    if(convert_to_int) {
+        const char* dot = std::find(value, end, '.');
+        if(dot < end && std::all_of(dot + 1, end, [](char c) { return c == '0'; }))
+            end = dot;
+    }
+    return end;
+}
+
+//adds one text value to the sample's block
+static void add_sums_value(SampleSums* sample, const char* value, const char* end, bool convert_to_int) {
+    end = trim_sums_value(value, end, convert_to_int);
+    sample->starts.push_back(sample->text.size());
+    sample->text.append(value, end - value);
+    sample->text.push_back('\0');
+}
+
+//appends row r of the sample's current block to the text output,
+//--sums-binary values formatted as the text sums would have been, or w/ all of their digits when exact
+static void append_sums_value(const SampleSums& sample, long r, bool convert_to_int, bool exact, std::string* out) {
+    if(sample.blank) {
+        for(size_t c = 0; c < sample.columns; c++) {
+            if(c > 0)
+                out->push_back('\t');
+            out->push_back('0');
+        }
+        return;
+    }
+    if(sample.encoding < 0) {
+        out->append(&sample.text[sample.starts[r]]);
+        return;
+    }
+    char buf[64];
+    int len;
+    if(sample.encoding == SUMS_FLOAT64)
+        len = snprintf(buf, sizeof(buf), exact?"%.17g":"%.3f", sample.doubles[r]);
     else
-        return go_bw(fname_arg, argc, argv, op, bam_fh, nthreads, keep_order, has_annotation, afp, &annotations, &annotation_chrs_seen, prefix, sum_annotation, &chrm_order, auc_file);
+        len = snprintf(buf, sizeof(buf), "%" PRId64, sample.ints[r]);
+    out->append(buf, trim_sums_value(buf, buf + len, convert_to_int) - buf);
+}
+
+//reads the next value of a --sums-binary file into the sample's block, false at its end
+static bool read_sums_binary_value(SampleSums* sample) {
+    if(sample->encoding == SUMS_FLOAT64) {
+        double value;
+        if(fread(&value, sizeof(double), 1, sample->fp) != 1)
+            return false;
+        sample->doubles.push_back(value);
+        return true;
+    }
+    uint64_t zz = 0;
+    int c;
+    for(int shift = 0; (c = fgetc(sample->fp)) != EOF; shift += 7) {
+        zz |= (uint64_t) (c & 0x7f) << shift;
+        if(!(c & 0x80))
+            break;
+    }
+    if(c == EOF)
+        return false;
+    sample->prev += (int64_t) (zz >> 1) ^ -(int64_t) (zz & 1);
+    sample->ints.push_back(sample->prev);
+    return true;
+}
+
+//checks for a --sums-binary header, setting the sample's encoding & the offset of its values if it has one
+static int read_sums_binary_header(SampleSums* sample, uint64_t* checksum) {
+    FILE* fp = fopen(sample->path.c_str(), "rb");
+    if(!fp)
+        return -1;
+    SumsBinaryHeader header;
+    if(fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, SUMS_BINARY_MAGIC, 8) == 0) {
+        sample->encoding = header.encoding;
+        sample->offset = sizeof(header) + (header.id_len + 7) / 8 * 8;
+        *checksum = header.annotation_checksum;
+    }
+    fclose(fp);
+    return 0;
+}
+
+//reads up to nrows values (the last column of each line, the whole line of a group merge's file, or from a --sums-binary file)
+//of the sample's next block, returning how many were read. the file is opened on the 1st block & kept open
+static long read_sums_block(SampleSums* sample, const long nrows, bool convert_to_int, char** line, size_t* length) {
+    sample->text.clear();
+    sample->starts.clear();
+    sample->doubles.clear();
+    sample->ints.clear();
+    if(sample->blank)
+        return 0;
+    if(!sample->fp) {
+        sample->fp = fopen(sample->path.c_str(), sample->encoding >= 0?"rb":"r");
+        if(!sample->fp || fseek(sample->fp, sample->offset, SEEK_SET) != 0)
+            return -1;
+    }
+    long n = 0;
+    ssize_t bytes_read;
+    while(n < nrows && sample->encoding >= 0 && read_sums_binary_value(sample))
+        n++;
+    while(n < nrows && sample->encoding < 0 && (bytes_read = getline(line, length, sample->fp)) != -1) {
+        char* value = *line;
+        char* end = *line + bytes_read;
+        while(end > value && (end[-1] == '\n' || end[-1] == '\r'))
+            end--;
+        for(char* c = end; c > *line && sample->columns == 1; c--) {
+            if(c[-1] == '\t') {
+                value = c;
+                break;
+            }
+        }
+        add_sums_value(sample, value, end, convert_to_int && sample->columns == 1);
+        n++;
+    }
+    return n;
+}
+
+//a fixed set of threads reading each block of the samples being merged,
+//taking the next sample until there are none left for the block
+struct SumsReaderPool {
+    std::vector<SampleSums>* samples = nullptr;
+    long nrows = 0;
+    bool convert_to_int = false;
+    std::vector<long>* rows_read = nullptr;
+    size_t next_sample = 0;
+    //samples of the current block still being read
+    size_t pending = 0;
+    bool quit = false;
+    std::mutex mutex;
+    std::condition_variable block_started;
+    std::condition_variable block_done;
+    std::vector<std::thread> threads;
+};
+
+static void sums_reader_worker(SumsReaderPool* pool) {
+    size_t length = LINE_BUFFER_LENGTH;
+    char* line = (char*) std::malloc(length);
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    while(true) {
+        pool->block_started.wait(lock, [pool] { return pool->quit || (pool->samples && pool->next_sample < pool->samples->size()); });
+        if(pool->quit)
+            break;
+        const size_t i = pool->next_sample++;
+        lock.unlock();
+        const long n = read_sums_block(&(*pool->samples)[i], pool->nrows, pool->convert_to_int, &line, &length);
+        lock.lock();
+        (*pool->rows_read)[i] = n;
+        if(--pool->pending == 0)
+            pool->block_done.notify_one();
+    }
+    std::free(line);
+}
+
+//reads the next block of every sample w/ the pool's threads, waiting for all of them
+static void read_sums_blocks(SumsReaderPool* pool, std::vector<SampleSums>* samples, const long nrows, bool convert_to_int, std::vector<long>* rows_read) {
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->samples = samples;
+    pool->nrows = nrows;
+    pool->convert_to_int = convert_to_int;
+    pool->rows_read = rows_read;
+    pool->next_sample = 0;
+    pool->pending = samples->size();
+    pool->block_started.notify_all();
+    pool->block_done.wait(lock, [pool] { return pool->pending == 0; });
+}
+
+//where a merge's rows go: the bgzipped matrix, a group's plain text temporary file or the --binary doubles
+struct SumsSink {
+    BGZF* bgzf = nullptr;
+    FILE* fp = nullptr;
+    FILE* bfp = nullptr;
+    //--sums-binary doubles w/ all their digits, for a temporary file later merged into --binary output
+    bool exact = false;
+    int write(const std::string& out) {
+        if(bgzf)
+            return bgzf_write(bgzf, out.c_str(), out.size()) < 0?-1:0;
+        if(fp)
+            return fwrite(out.c_str(), 1, out.size(), fp) == out.size()?0:-1;
+        return 0;
+    }
+};
+
+//merges the samples' files column by column a block of rows at a time into sink (after anything already in out),
+//returning the # of rows or -1 if they couldn't be read or written or don't have the same # of rows
+static int64_t merge_sums(std::vector<SampleSums>* samples, SumsReaderPool* pool, const long block_rows, bool convert_to_int,
+                          SumsSink* sink, std::string* out) {
+    int err = 0;
+    int64_t num_rows = 0;
+    std::vector<long> rows_read(samples->size());
+    std::vector<double> row_vals;
+    while(err == 0) {
+        read_sums_blocks(pool, samples, block_rows, convert_to_int, &rows_read);
+        //every non-blank sample has to have the same # of rows
+        long nrows = -1;
+        for(size_t i = 0; i < samples->size(); i++) {
+            const SampleSums& sample = (*samples)[i];
+            if(sample.blank)
+                continue;
+            if(rows_read[i] < 0) {
+                fprintf(stderr, "ERROR: could not read %s\n", sample.path.c_str());
+                err = -1;
+            }
+            else if(nrows == -1)
+                nrows = rows_read[i];
+            else if(rows_read[i] != nrows) {
+                fprintf(stderr, "ERROR: %s%s%s doesn't have the same # of rows as the other samples\n", sample.path.c_str(),
+                        sample.id.empty()?"":" for sample ", sample.id.c_str());
+                err = -1;
+            }
+        }
+        if(err != 0 || nrows <= 0)
+            break;
+        for(long r = 0; r < nrows; r++) {
+            row_vals.clear();
+            for(size_t i = 0; i < samples->size(); i++) {
+                if(sink->bfp)
+                    (*samples)[i].values(r, &row_vals);
+                else {
+                    append_sums_value((*samples)[i], r, convert_to_int, sink->exact, out);
+                    *out += i + 1 < samples->size()?"\t":"\n";
+                }
+            }
+            if(sink->bfp && fwrite(row_vals.data(), sizeof(double), row_vals.size(), sink->bfp) != row_vals.size())
+                err = -1;
+        }
+        num_rows += nrows;
+        if(sink->write(*out) != 0)
+            err = -1;
+        out->clear();
+    }
+    if(err == 0 && sink->write(*out) != 0)
+        err = -1;
+    out->clear();
+    for(auto& sample : *samples) {
+        if(sample.fp)
+            fclose(sample.fp);
+        sample.fp = nullptr;
+    }
+    return err == 0?num_rows:-1;
+}
+
+//deletes the temporary files of a group merge level
+static void remove_group_files(const std::vector<SampleSums>& groups) {
+    for(auto const& group : groups)
+        remove(group.path.c_str());
+}
+
+//merges the per-sample sum files in the manifest column by column a block of rows at a time
+//(so memory is bounded by the block size rather than the # of rows), replacing the sample_aggregation
+//group/paste pipeline, see the Aggregate section of the usage.
+//like that pipeline, more than AGGREGATE_MAX_OPEN_FILES samples are merged in groups first so every file is only opened once
+int go_aggregate(int argc, const char** argv) {
+    if(argc < 2) {
+        std::cerr << "ERROR: aggregate requires a manifest of sum files" << std::endl;
+        return -1;
+    }
+    const char* manifest_fn = argv[1];
+    const char* prefix = manifest_fn;
+    if(has_option(argv, argv+argc, "--prefix"))
+        prefix = *(get_option(argv, argv+argc, "--prefix"));
+    int nthreads = 1;
+    if(has_option(argv, argv+argc, "--threads"))
+        nthreads = std::max(1, atoi(*(get_option(argv, argv+argc, "--threads"))));
+    long block_rows = 4096;
+    if(has_option(argv, argv+argc, "--block-rows"))
+        block_rows = std::max(1L, atol(*(get_option(argv, argv+argc, "--block-rows"))));
+    const bool convert_to_int = has_option(argv, argv+argc, "--convert-to-int");
+    const bool binary = has_option(argv, argv+argc, "--binary");
+
+    std::vector<SampleSums> samples;
+    std::ifstream manifest(manifest_fn);
+    if(!manifest) {
+        std::cerr << "ERROR: could not open manifest " << manifest_fn << std::endl;
+        return -1;
+    }
+    std::string mline;
+    int num_binary = 0;
+    uint64_t bed_checksum = 0;
+    while(getline(manifest, mline)) {
+        strvec fields;
+        split_string(mline, '\t', &fields);
+        if(fields.size() < 2)
+            continue;
+        //<sample ID> <file> or sample_aggregation's <study> <sample ID> <file> ...
+        SampleSums sample;
+        sample.id = fields.size() == 2?fields[0]:fields[1];
+        sample.path = fields.size() == 2?fields[1]:fields[2];
+        struct stat fstat;
+        sample.blank = stat(sample.path.c_str(), &fstat) != 0 || fstat.st_size == 0;
+        if(sample.blank)
+            fprintf(stderr, "WARNING: %s for sample %s is empty or missing, filling w/ 0's\n", sample.path.c_str(), sample.id.c_str());
+        //--sums-binary files have to be over the same annotation
+        uint64_t checksum = 0;
+        if(!sample.blank && read_sums_binary_header(&sample, &checksum) == 0 && sample.encoding >= 0) {
+            if(num_binary++ > 0 && checksum != bed_checksum) {
+                fprintf(stderr, "ERROR: %s for sample %s is over a different annotation than the other samples\n", sample.path.c_str(), sample.id.c_str());
+                return -1;
+            }
+            bed_checksum = checksum;
+        }
+        samples.push_back(sample);
+    }
+    if(samples.empty()) {
+        std::cerr << "ERROR: no samples in manifest " << manifest_fn << std::endl;
+        return -1;
+    }
+    const size_t num_samples = samples.size();
+
+    char fn[1024];
+    SumsSink sink;
+    std::string out;
+    if(binary) {
+        snprintf(fn, sizeof(fn), "%s.samples.tsv", prefix);
+        FILE* sfp = fopen(fn, "w");
+        if(!sfp) {
+            fprintf(stderr, "ERROR: could not write %s\n", fn);
+            return -1;
+        }
+        for(auto const& sample : samples)
+            fprintf(sfp, "%s\n", sample.id.c_str());
+        fclose(sfp);
+        snprintf(fn, sizeof(fn), "%s.bin", prefix);
+        sink.bfp = fopen(fn, "wb");
+        //the # of rows is filled in at the end
+        const uint64_t header[3] = { SUMS_MATRIX_MAGIC, 0, num_samples };
+        if(sink.bfp)
+            fwrite(header, sizeof(uint64_t), 3, sink.bfp);
+    }
+    else {
+        snprintf(fn, sizeof(fn), "%s.tsv.gz", prefix);
+        sink.bgzf = bgzf_open(fn, "w");
+        if(sink.bgzf && nthreads > 1)
+            bgzf_mt(sink.bgzf, nthreads, 256);
+        for(size_t i = 0; i < num_samples; i++) {
+            out += samples[i].id;
+            out += i + 1 < num_samples?"\t":"\n";
+        }
+    }
+    if(!sink.bgzf && !sink.bfp) {
+        fprintf(stderr, "ERROR: could not write %s\n", fn);
+        return -1;
+    }
+
+    SumsReaderPool pool;
+    for(int i = 0; i < nthreads; i++)
+        pool.threads.push_back(std::thread(sums_reader_worker, &pool));
+    int err = 0;
+    //merge groups of samples (then of groups) into <prefix>.aggregate.<level>.<group>.tmp until they can all be open at once
+    for(int level = 0; err == 0 && samples.size() > AGGREGATE_MAX_OPEN_FILES; level++) {
+        std::vector<SampleSums> groups;
+        for(size_t first = 0; err == 0 && first < samples.size(); first += AGGREGATE_MAX_OPEN_FILES) {
+            std::vector<SampleSums> members(samples.begin() + first, samples.begin() + std::min(samples.size(), first + AGGREGATE_MAX_OPEN_FILES));
+            SampleSums group;
+            group.path = std::string(prefix) + ".aggregate." + std::to_string(level) + "." + std::to_string(groups.size()) + ".tmp";
+            group.columns = 0;
+            for(auto const& member : members)
+                group.columns += member.columns;
+            SumsSink group_sink;
+            group_sink.exact = binary;
+            group_sink.fp = fopen(group.path.c_str(), "w");
+            if(!group_sink.fp) {
+                fprintf(stderr, "ERROR: could not write %s\n", group.path.c_str());
+                err = -1;
+                break;
+            }
+            std::string group_out;
+            const int64_t group_rows = merge_sums(&members, &pool, block_rows, convert_to_int, &group_sink, &group_out);
+            if(fclose(group_sink.fp) != 0 || group_rows < 0)
+                err = -1;
+            //all of its samples were empty or missing
+            group.blank = group_rows == 0;
+            groups.push_back(group);
+        }
+        if(level > 0)
+            remove_group_files(samples);
+        samples.swap(groups);
+        if(err != 0)
+            remove_group_files(samples);
+    }
+    int64_t num_rows = -1;
+    if(err == 0) {
+        num_rows = merge_sums(&samples, &pool, block_rows, convert_to_int, &sink, &out);
+        if(num_rows < 0)
+            err = -1;
+        if(num_samples > AGGREGATE_MAX_OPEN_FILES)
+            remove_group_files(samples);
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.quit = true;
+    }
+    pool.block_started.notify_all();
+    for(auto& t : pool.threads)
+        t.join();
+
+    if(sink.bgzf && bgzf_close(sink.bgzf) != 0)
+        err = -1;
+    if(sink.bfp) {
+        const uint64_t rows = err == 0?num_rows:0;
+        fseek(sink.bfp, sizeof(uint64_t), SEEK_SET);
+        fwrite(&rows, sizeof(uint64_t), 1, sink.bfp);
+        if(fclose(sink.bfp) != 0)
+            err = -1;
+    }
+    if(err == 0)
+        fprintf(stderr, "aggregated %" PRId64 " rows from %lu samples\n", num_rows, num_samples);
+    return err;
 }
 
 int get_file_format_extension(const char* fname) {
@@ -2119,7 +4774,9 @@ int get_file_format_extension(const char* fname) {
             || strcmp("BW", &(fname[slen-2])) == 0
             || strcmp("bigwig", &(fname[slen-6])) == 0
             || strcmp("bigWig", &(fname[slen-6])) == 0
-            || strcmp("BigWig", &(fname[slen-6])) == 0)
+            || strcmp("BigWig", &(fname[slen-6])) == 0
+            //a list of BigWigs
+            || strcmp("txt", &(fname[slen-3])) == 0)
         return BW_FORMAT;
     return UNKNOWN_FORMAT;
 }
@@ -2135,6 +4792,8 @@ int main(int argc, const char** argv) {
         print_version();
         return 0;
     }
+    if(strcmp(argv[0], "aggregate") == 0)
+        return go_aggregate(argc, argv);
     if(has_option(argv, argv+argc, "--bwbuffer")) {
         const char* opstr = *(get_option(argv, argv+argc, "--bwbuffer"));
         BW_READ_BUFFER = atol(opstr);
@@ -2142,6 +4801,10 @@ int main(int argc, const char** argv) {
     if(has_option(argv, argv+argc, "--sums-only")) {
         SUMS_ONLY = true;
     }
+    if(has_option(argv, argv+argc, "--sums-binary"))
+        SUMS_BINARY = SUMS_FLOAT64;
+    if(has_option(argv, argv+argc, "--sums-binary-varint"))
+        SUMS_BINARY = SUMS_DELTA_VARINT;
     const char *fname_arg = get_positional_n(argv, argv+argc, 0);
     if(!fname_arg) {
         std::cerr << "ERROR: Could not find <bam|bw> positional arg" << std::endl;
@@ -2166,14 +4829,24 @@ int main(int argc, const char** argv) {
         const htsFormat* format = hts_get_format(bam_fh);
         const char* hts_format_ex = hts_format_file_extension(format);
     }
-    Op op = csum;
+    //comma separated list of ops, each output as a column
+    op_list ops;
     if(has_option(argv, argv+argc, "--op")) {
-        const char* opstr = *(get_option(argv, argv+argc, "--op"));
-        op = get_operation(opstr);
+        strvec fields;
+        split_string(*(get_option(argv, argv+argc, "--op")), ',', &fields);
+        if(parse_ops(fields, 0, &ops) != 0)
+            return -1;
     }
+    if(ops.empty())
+        ops.push_back(csum);
+    if(has_option(argv, argv+argc, "--min-coverage"))
+        BASES_MIN_COVERAGE = atof(*(get_option(argv, argv+argc, "--min-coverage")));
+    if(has_option(argv, argv+argc, "--approximate"))
+        APPROXIMATE_MIN_LENGTH = atol(*(get_option(argv, argv+argc, "--approximate")));
     std::ios::sync_with_stdio(false);
-    if(!is_bam || op == cmean)
-        return go<double>(fname_arg, argc, argv, op, bam_fh, is_bam);
+    //BAM coverage stats are integers other than means & medians (see print_stats)
+    if(!is_bam)
+        return go<double>(fname_arg, argc, argv, ops, bam_fh, is_bam);
     else
-        return go<long>(fname_arg, argc, argv, op, bam_fh, is_bam);
+        return go<long>(fname_arg, argc, argv, ops, bam_fh, is_bam);
 }
@@ -32,6 +32,9 @@ diff tests/test2.bam.jxs.tsv test2.bam.jxs.tsv
 #test just total auc
 time ./md_runner test.bam.all.bw | grep "AUC" > test.bw1.total_auc
 diff test.bw1.total_auc tests/testbw1.total_auc
+#--exact reads every interval rather than taking the header's summary
+./md_runner test.bam.all.bw --exact | grep "AUC" > test.bw1.exact.total_auc
+diff test.bw1.exact.total_auc tests/testbw1.total_auc
 
 #test bigwig2sums/auc
 time ./md_runner test.bam.all.bw --annotation tests/testbw1.bed --auc --prefix test.bam.bw1 --no-annotation-stdout --no-auc-stdout
@@ -64,6 +67,159 @@ diff <(tail -n1 tests/test3.out.tsv) t3.auc.tsv
 ./md_runner tests/test3.bam --coverage  --min-unique-qual 10 --bigwig --auc --prefix test3 --no-auc-stdout
 diff tests/test3.auc.out.tsv test3.auc.tsv
 
+#multiple --min-unique-qual thresholds in one pass, the 10 track should match the single threshold run
+./md_runner tests/test.bam --auc --min-unique-qual 1,10 --annotation tests/test_exons.bed --prefix test.bam.mq --no-annotation-stdout --no-auc-stdout
+diff tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv test.bam.mq.annotation.tsv
+diff tests/test.bam.mosdepth.unique.per-base.exon_sums.tsv test.bam.mq.unique.q10.tsv
+diff <(fgrep "UNIQUE_READS_ALL_BASES" tests/test.bam.mosdepth.bwtool.all_aucs | cut -f 2) <(fgrep "UNIQUE_READS_Q10_ALL_BASES" test.bam.mq.auc.tsv | cut -f 2)
+
+#strand tracks, plus + minus should add up to all and swap between library types
+./md_runner tests/test.bam --auc --stranded fr-firststrand --annotation tests/test_exons.bed --prefix test.bam.fs --no-annotation-stdout --no-auc-stdout
+./md_runner tests/test.bam --auc --stranded fr-secondstrand --annotation tests/test_exons.bed --prefix test.bam.ss --no-annotation-stdout --no-auc-stdout
+diff test.bam.fs.plus.tsv test.bam.ss.minus.tsv
+diff tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv <(paste test.bam.fs.plus.tsv test.bam.fs.minus.tsv | cut -f 1-4,8 | perl -ane 'print join("\t", @F[0..2], $F[3]+$F[4])."\n";')
+diff <(fgrep "ALL_READS_ALL_BASES" tests/test.bam.mosdepth.bwtool.all_aucs | cut -f 2) <(fgrep "STRAND_READS_ALL_BASES" test.bam.fs.auc.tsv | awk '{ s+=$2 } END { print s }')
+#the strand tracks count toward the limit on tracks
+if ./md_runner tests/test.bam --auc --stranded fr-firststrand --min-unique-qual $(seq -s, 1 31) --prefix test.bam.toomany --no-auc-stdout 2>> test_run_out; then exit 1; fi
+
+#per read group coverage, the groups should add up to the whole BAM
+./md_runner tests/test.bam --auc --split-by RG --annotation tests/test_exons.bed --prefix test.bam.rg --no-auc-stdout
+diff <(fgrep "ALL_READS_ALL_BASES" tests/test.bam.mosdepth.bwtool.all_aucs | cut -f 2) <(fgrep "ALL_READS_ALL_BASES" test.bam.rg.auc.tsv | awk '{ s+=$2 } END { print s }')
+diff <(cut -f 4 tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv) <(paste test.bam.rg.*.annotation.tsv | awk '{ s=0; for(i=4; i<=NF; i+=4) s+=$i; print s }')
+
+#binary annotation cache, the 2nd run maps the cache built by the 1st
+./md_runner tests/test.bam --annotation tests/test_exons.bed --annotation-cache test.exons.cache --prefix test.bam.cache --no-annotation-stdout
+./md_runner tests/test.bam --annotation tests/test_exons.bed --annotation-cache test.exons.cache --prefix test.bam.cache --no-annotation-stdout
+diff tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv test.bam.cache.annotation.tsv
+
+#--keep-order goes by the BAM/BigWig's chromosome order but keeps the (unsorted) BED rows' order within each
+tac tests/test_exons.bed > test_exons.rev.bed
+./md_runner tests/test.bam --annotation test_exons.rev.bed --keep-order --prefix test.bam.rev --no-annotation-stdout
+diff <(tac tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv | fgrep -w chr10; fgrep -w GL000219.1 tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv) test.bam.rev.annotation.tsv
+
+#gzip'd annotation parsed in parallel chunks
+gzip -c tests/test_exons.bed > test_exons.bed.gz
+./md_runner tests/test.bam --annotation test_exons.bed.gz --threads 2 --prefix test.bam.gz --no-annotation-stdout
+diff tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv test.bam.gz.annotation.tsv
+
+#a missing end coordinate is an error rather than read from the next line
+printf "chr10\t100\t\nchr10\t200\t300\n" > test_exons.bad.bed
+if ./md_runner tests/test.bam --annotation test_exons.bad.bed --prefix test.bam.bad --no-annotation-stdout 2>> test_run_out; then exit 1; fi
+
+#repeated intervals are computed once but still output once per BED row
+cat tests/test_exons.bed tests/test_exons.bed > test_exons.dup.bed
+./md_runner tests/test.bam --annotation test_exons.dup.bed --prefix test.bam.dup --no-annotation-stdout
+diff <(sort tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv) <(sort test.bam.dup.annotation.tsv)
+
+#name groups sum over the union of their intervals, so the nested copy of each exon doesn't add to it
+awk -v OFS='\t' '{ print $1,$2,$3,"g"NR; print $1,$2,$2+1,"g"NR }' tests/test_exons.bed > test_exons.named.bed
+./md_runner tests/test.bam --annotation test_exons.named.bed --aggregate-by-name --prefix test.bam.named --no-annotation-stdout
+diff <(awk -v OFS='\t' '{ print "g"NR,$3-$2,$4 }' tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv) <(cut -f 1-3 test.bam.named.annotation.by_name.tsv)
+#the name groups need a 4th column
+if ./md_runner tests/test.bam --annotation tests/test_exons.bed --aggregate-by-name --prefix test.bam.noname --no-annotation-stdout 2>> test_run_out; then exit 1; fi
+#an existing annotation cache is passed over so the name groups are still read
+./md_runner tests/test.bam --annotation test_exons.named.bed --annotation-cache test.exons.named.cache --prefix test.bam.named.cache --no-annotation-stdout
+./md_runner tests/test.bam --annotation test_exons.named.bed --annotation-cache test.exons.named.cache --aggregate-by-name --prefix test.bam.named.cache --no-annotation-stdout
+diff test.bam.named.annotation.by_name.tsv test.bam.named.cache.annotation.by_name.tsv
+
+#several annotations summed from one pass, each w/ its own output & op
+./md_runner tests/test.bam --min-unique-qual 10 --annotation tests/test_exons.bed --annotation tests/test_exons.bed,exons2 --prefix test.bam.multi --no-annotation-stdout
+diff tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv test.bam.multi.annotation.tsv
+diff tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv test.bam.multi.exons2.tsv
+diff tests/test.bam.mosdepth.unique.per-base.exon_sums.tsv test.bam.multi.exons2.unique.tsv
+#default labels only drop the extension, and two annotations can't share one
+cp tests/test_exons.bed test_exons.v1.bed
+cp tests/test_exons.bed test_exons.v2.bed
+./md_runner tests/test.bam --annotation tests/test_exons.bed --annotation test_exons.v1.bed --annotation test_exons.v2.bed --prefix test.bam.labels --no-annotation-stdout
+diff tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv test.bam.labels.test_exons.v1.tsv
+diff tests/test.bam.mosdepth.annotation.per-base.exon_sums.tsv test.bam.labels.test_exons.v2.tsv
+if ./md_runner tests/test.bam --annotation tests/test_exons.bed --annotation test_exons.v1.bed,dup --annotation test_exons.v2.bed,dup --prefix test.bam.labels.dup --no-annotation-stdout 2>> test_run_out; then exit 1; fi
+./md_runner test.bam.all.bw --annotation tests/testbw2.bed,max,max --annotation tests/testbw2.bed,mean,mean --prefix bw2.multi >> test_run_out 2>&1
+diff tests/testbw2.bed.max bw2.multi.max.tsv
+diff tests/testbw2.bed.mean bw2.multi.mean.tsv
+#all of the ops from one walk over a BigWig's intervals
+./md_runner test.bam.all.bw --annotation tests/testbw2.bed --op sum,mean,min,max --prefix bw2.ops --no-annotation-stdout >> test_run_out 2>&1
+diff <(paste tests/testbw2.bed.out.tsv <(cut -f 4 tests/testbw2.bed.mean) <(cut -f 4 tests/testbw2.bed.min) <(cut -f 4 tests/testbw2.bed.max)) bw2.ops.annotation.tsv
+#chromosomes of a single BigWig spread over threads
+./md_runner test.bam.all.bw --threads 2 --annotation tests/testbw2.bed --auc --prefix bw2.threads --no-annotation-stdout --no-auc-stdout >> test_run_out 2>&1
+diff tests/testbw2.bed.out.tsv bw2.threads.annotation.tsv
+diff tests/testbw2.annot_auc bw2.threads.auc.tsv
+#a list of BigWigs, each w/ its own output, pulled by the threads largest first
+ln -sf test.bam.all.bw bw2.list1.bw
+ln -sf test.bam.all.bw bw2.list2.bw
+printf "bw2.list1.bw\nbw2.list2.bw\n" > bw2.list.txt
+./md_runner bw2.list.txt --threads 2 --annotation tests/testbw2.bed > bw2.list.aucs 2>> test_run_out
+diff tests/testbw2.bed.out.tsv bw2.list1.bw.all.tsv
+diff tests/testbw2.bed.out.tsv bw2.list2.bw.all.tsv
+diff <(cut -f 2 tests/testbw2.annot_auc) <(cut -f 2 bw2.list.aucs | sort -u)
+#the same list, both BigWigs summed together chromosome by chromosome
+rm -f bw2.list1.bw.all.tsv bw2.list2.bw.all.tsv
+./md_runner bw2.list.txt --batch 2 --annotation tests/testbw2.bed > /dev/null 2>> test_run_out
+diff tests/testbw2.bed.out.tsv bw2.list1.bw.all.tsv
+diff tests/testbw2.bed.out.tsv bw2.list2.bw.all.tsv
+#the same list as one matrix w/ a column per BigWig & a manifest of their AUCs
+./md_runner bw2.list.txt --matrix --annotation tests/testbw2.bed --prefix bw2.list > /dev/null 2>> test_run_out
+diff <(paste tests/testbw2.bed.out.tsv <(cut -f 4 tests/testbw2.bed.out.tsv)) <(gzip -dc bw2.list.matrix.tsv.gz | tail -n +2)
+diff <(printf "0\tbw2.list1.bw\tbw2.list1.bw\t%s\tSUCCESS\n1\tbw2.list2.bw\tbw2.list2.bw\t%s\tSUCCESS\n" $(cut -f 2 tests/testbw2.annot_auc) $(cut -f 2 tests/testbw2.annot_auc)) bw2.list.manifest.tsv
+#merge the list's per-BigWig sums into one matrix, filling in a missing sample
+printf "S1\tbw2.list1.bw.all.tsv\nS2\tbw2.list2.bw.all.tsv\nS3\tbw2.missing.tsv\n" > bw2.agg.manifest
+./md_runner aggregate bw2.agg.manifest --prefix bw2.agg --convert-to-int --block-rows 3 >> test_run_out 2>&1
+diff <(printf "S1\tS2\tS3\n"; cut -f 4 tests/testbw2.bed.out.tsv | sed 's/\.0*$//' | awk '{print $1"\t"$1"\t0"}') <(gzip -dc bw2.agg.tsv.gz)
+#more samples than are merged at once go through temporary group files first
+for i in $(seq 1 1001); do printf "S$i\tbw2.list1.bw.all.tsv\n"; done > bw2.agg.many.manifest
+./md_runner aggregate bw2.agg.many.manifest --prefix bw2.agg.many --convert-to-int --threads 2 >> test_run_out 2>&1
+diff <(seq 1 1001 | awk '{ printf("%sS%d", NR>1?"\t":"", $1) } END { print "" }'; cut -f 4 tests/testbw2.bed.out.tsv | sed 's/\.0*$//' | awk '{ for(i=1; i<=1001; i++) printf("%s%s", $1, i<1001?"\t":"\n") }') <(gzip -dc bw2.agg.many.tsv.gz)
+ls bw2.agg.many.aggregate.* 2> /dev/null && exit 1
+#binary sums, as doubles & as varint deltas, which aggregate reads directly
+./md_runner test.bam.all.bw --annotation tests/testbw2.bed --sums-binary --prefix bw2.bin >> test_run_out 2>&1
+./md_runner test.bam.all.bw --annotation tests/testbw2.bed --sums-binary-varint --prefix bw2.varint >> test_run_out 2>&1
+printf "F\tbw2.bin.sums.bin\nV\tbw2.varint.sums.bin\n" > bw2.bin.manifest
+./md_runner aggregate bw2.bin.manifest --prefix bw2.bin.agg --convert-to-int >> test_run_out 2>&1
+diff <(printf "F\tV\n"; cut -f 4 tests/testbw2.bed.out.tsv | sed 's/\.0*$//' | awk '{print $1"\t"$1}') <(gzip -dc bw2.bin.agg.tsv.gz)
+#binary to binary, the doubles are copied over as they are
+printf "F\tbw2.bin.sums.bin\n" > bw2.bin.one.manifest
+./md_runner aggregate bw2.bin.one.manifest --prefix bw2.bin.one --binary >> test_run_out 2>&1
+cmp <(tail -c $((8*$(wc -l < tests/testbw2.bed))) bw2.bin.sums.bin) <(tail -c +25 bw2.bin.one.bin)
+#name groups aren't summed from BigWigs
+if ./md_runner test.bam.all.bw --annotation test_exons.named.bed --aggregate-by-name --prefix bw2.named --no-annotation-stdout >> test_run_out 2>&1; then exit 1; fi
+#an unsorted BED w/ --keep-order, its rows are already in the BigWig's chromosome order
+./md_runner test.bam.all.bw --annotation tests/testbw2.bed --keep-order --prefix bw2.keep --no-annotation-stdout >> test_run_out 2>&1
+diff tests/testbw2.bed.out.tsv bw2.keep.annotation.tsv
+#the same w/ the chromosomes over threads, a duplicated row included
+cat tests/testbw2.bed <(head -2 tests/testbw2.bed) > bw2.keep.dup.bed
+./md_runner test.bam.all.bw --threads 1 --annotation bw2.keep.dup.bed --keep-order --prefix bw2.keep.t1 --no-annotation-stdout >> test_run_out 2>&1
+./md_runner test.bam.all.bw --threads 2 --annotation bw2.keep.dup.bed --keep-order --prefix bw2.keep.t2 --no-annotation-stdout >> test_run_out 2>&1
+diff bw2.keep.t1.annotation.tsv bw2.keep.t2.annotation.tsv
+#regions shorter than --approximate still come from the base level values
+./md_runner test.bam.all.bw --annotation tests/testbw2.bed --op sum,mean,min,max --approximate 1000 --prefix bw2.approx --no-annotation-stdout >> test_run_out 2>&1
+diff <(paste tests/testbw2.bed.out.tsv <(cut -f 4 tests/testbw2.bed.mean) <(cut -f 4 tests/testbw2.bed.min) <(cut -f 4 tests/testbw2.bed.max)) bw2.approx.annotation.tsv
+#regions at or over --approximate come from the zoom levels, all of GL000219.1's so it reads no base level data,
+#they should be within 1% of the exact values
+printf "chr10\t8750000\t8760000\nchr10\t8756697\t8756762\nGL000219.1\t0\t179198\nGL000219.1\t160000\t170000\n" > bw2.approx.long.bed
+./md_runner test.bam.all.bw --annotation bw2.approx.long.bed --op sum,mean,min,max --prefix bw2.exact.long --no-annotation-stdout >> test_run_out 2>&1
+./md_runner test.bam.all.bw --annotation bw2.approx.long.bed --op sum,mean,min,max --approximate 1000 --prefix bw2.approx.long --no-annotation-stdout >> test_run_out 2>&1
+paste bw2.exact.long.annotation.tsv bw2.approx.long.annotation.tsv | awk '{ for(i=4; i<=7; i++) { d=$i-$(i+7); if(d<0) d=-d; if(d > 0.01*($i<0?-$i:$i) + 0.001) { print "approximate "$0; exit 1 } } }'
+diff <(cut -f 1-3 bw2.exact.long.annotation.tsv) <(cut -f 1-3 bw2.approx.long.annotation.tsv)
+
+#several statistics per interval from BAM coverage in one pass, 6x14 + 20x26 and 6x9 + 20x9 bases
+printf "chr10\t8756700\t8756740\nchr10\t8756705\t8756723\n" > test_stats.bed
+./md_runner tests/test.bam --annotation test_stats.bed --op sum,mean,min,max,median,bases --min-coverage 15 --prefix test.bam.stats --no-annotation-stdout
+diff <(printf "chr10\t8756700\t8756740\t604\t15.100\t6\t20\t20.000\t26\nchr10\t8756705\t8756723\t234\t13.000\t6\t20\t13.000\t9\n") test.bam.stats.annotation.tsv
+./md_runner test.bam.all.bw --annotation test_stats.bed --op median,bases --min-coverage 15 --prefix test.bw.stats --no-annotation-stdout >> test_run_out 2>&1
+diff <(printf "chr10\t8756700\t8756740\t20.000\t26.000\nchr10\t8756705\t8756723\t13.000\t9.000\n") test.bw.stats.annotation.tsv
+
+#UMI dedup, 2nd mates follow the 1st, 1 mismatch UMIs collapse w/ --umi-mismatch
+./md_runner tests/umis.sam --auc --umi-dedup UB --prefix umis --no-auc-stdout
+diff <(echo 160) <(fgrep "ALL_READS_ALL_BASES" umis.auc.tsv | cut -f 2)
+./md_runner tests/umis.sam --auc --umi-dedup UB --umi-mismatch --prefix umis.mm --no-auc-stdout
+diff <(echo 120) <(fgrep "ALL_READS_ALL_BASES" umis.mm.auc.tsv | cut -f 2)
+
+#per cell barcode counts over the annotation, alignments then distinct UMIs
+./md_runner tests/barcodes.sam --annotation tests/barcodes.bed --barcode-counts --prefix barcodes
+diff tests/barcodes.mtx barcodes.barcodes.mtx
+./md_runner tests/barcodes.sam --annotation tests/barcodes.bed --barcode-counts --umi-tag UB --prefix barcodes.umi
+diff <(echo 7) <(tail -n +3 barcodes.umi.barcodes.mtx | awk '{ s+=$3 } END { print s }')
+
 #long reads support for junctions
 ./md_runner tests/long_reads.bam --junctions --prefix long_reads.bam --long-reads
 diff tests/long_reads.bam.jxs.tsv long_reads.bam.jxs.tsv
@@ -79,5 +235,5 @@ time ./md_runner test.bam.all.bw --sums-only --annotation tests/testbw2.bed --pr
 diff test.bam.bw2.annotation.tsv <(cut -f 4 tests/testbw2.bed.out.tsv)
 
 #clean up any previous test files
-rm -f test*tsv test*auc bw2* test3* test2* t3.* long_reads.bam.jxs.tsv test_run_out *null*.unique.tsv test.*.bw auc.single
+rm -f test*tsv test*auc bw2* test3* test2* t3.* long_reads.bam.jxs.tsv test_run_out *null*.unique.tsv test.*.bw auc.single barcodes.* umis.* test.exons.cache test.exons.named.cache test_exons.bed.gz test_exons.rev.bed test_exons.bad.bed test_exons.v1.bed test_exons.v2.bed test_exons.dup.bed test_exons.named.bed test_stats.bed
 